@@ -16,6 +16,9 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 /// @brief 
@@ -27,12 +30,12 @@ void initChunk(Chunk* chunk) {
  * @param byte byte to append to chunk
  * @param line the source code line number the chunk is associated with. Used for printing where errors are.
  */
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
@@ -46,21 +49,38 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
  * @param value The value to add to the bytecode
  * @return Index of where the value was added in the chunk
  */
-int addConstant(Chunk* chunk, Value value) {
-    push(value); // GC fix - have the value live on the stack before allocations.
-    writeValueArray(&chunk->constants, value);
-    pop();
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+    push(vm, value); // GC fix - have the value live on the stack before allocations.
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     // Return the index where the constant was appended so we can located it later
     return chunk->constants.count - 1;
 }
 
+/**
+ * @brief Add an empty inline cache for a property instruction to use
+ * @param chunk The bytecode the instruction belongs to
+ * @return Index of the new cache in the chunk
+ */
+int addInlineCache(VM* vm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
+
 /**
  * @brief Free a bytecode
  * @param chunk The bytecode to free
  */
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
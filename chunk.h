@@ -47,6 +47,32 @@ typedef enum {
     OP_METHOD
 } OpCode;
 
+// How many receiver shapes an inline cache remembers before it gives up and goes megamorphic.
+#define IC_POLYMORPHIC_SIZE 4
+
+/**
+ * @brief What a property name resolved to for one receiver shape.
+ * A shape belongs to a single class and fixes which fields exist, so a method found
+ * for a shape can't be shadowed by a field either.
+ */
+typedef struct {
+    ObjShape* shape; ///< Receiver shape this entry applies to, NULL while unused
+    int index; ///< Slot of the field, or -1 if the name resolved to a method
+    Value method; ///< The method's closure when index is -1
+    ObjShape* transition; ///< OP_SET_PROPERTY only - shape after adding the field, NULL if the shape already has it
+} CacheEntry;
+
+/**
+ * @brief Inline cache for one OP_GET_PROPERTY, OP_SET_PROPERTY or OP_INVOKE instruction.
+ * The first entry is the monomorphic case, the rest make it polymorphic. Once all of them are
+ * used, lookups at that instruction fall through to the VM's megamorphic cache.
+ * Instances in dictionary mode have no shape and always take the slow path.
+ */
+typedef struct {
+    int count; ///< Number of entries in use
+    CacheEntry entries[IC_POLYMORPHIC_SIZE];
+} InlineCache;
+
 /**
  * @brief Chunks are a sequence of bytecode
  */
@@ -56,11 +82,15 @@ typedef struct {
     uint8_t* code; ///< The array of bytes of code
     int* lines; ///< Array of lines to relate to source code, mirrors the code array and only stores the line number for the code
     ValueArray constants; ///< Array of constants used for bytecode
+    int cacheCount; ///< Number of inline caches used by property instructions
+    int cacheCapacity; ///< Maximum size of caches array
+    InlineCache* caches; ///< Inline caches, indexed by the 2 byte operand of the instructions that use them
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+int addInlineCache(VM* vm, Chunk* chunk);
 
 #endif
@@ -6,13 +6,39 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+// Build with -DNO_DEBUG_TRACE to stop dumping bytecode and tracing every instruction, which also lets the JIT in.
+#ifndef NO_DEBUG_TRACE
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Dispatch opcodes in run() through a table of label addresses ("computed goto") rather than a switch.
+// Needs the GCC/Clang labels-as-values extension, so other compilers get the portable switch.
+// Build with -DNO_COMPUTED_GOTO to force the switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Keep a rarely taken slow path out of line, so inlining it doesn't make its caller's fast path save
+// and restore registers it never uses.
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// Compile hot functions to x86-64 machine code (see jit.c). The generated code works on NaN boxed
+// values directly and needs mmap() for executable memory. It's off while tracing execution, since
+// compiled code doesn't go through run(), so it needs -DNO_DEBUG_TRACE. Build with -DNO_JIT to turn it off.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(NO_JIT)
+#define BASELINE_JIT
+#endif
+
 #endif
 
 #undef DEBUG_STRESS_GC
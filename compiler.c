@@ -6,19 +6,13 @@
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
-
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT, // =
@@ -33,7 +27,7 @@ typedef enum {
     PREC_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -82,19 +76,27 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
-
-Chunk* compilingChunk;
+/**
+ * @brief Everything one compile works on, so compiles in different VMs can run side by side.
+ */
+struct Parser {
+    VM* vm; //< VM the compiled functions are allocated in.
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    Compiler* compiler; //< Innermost function being compiled.
+    ClassCompiler* currentClass; //< Innermost class being compiled, NULL outside of one.
+};
 
-static Chunk* currentChunk() {
-    return &current->function->chunk;
+static Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -106,36 +108,36 @@ static void errorAt(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 /**
  * @brief Report error at previous token
  * @param message 
  */
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
 
 /**
  * @brief Report error at current token
  * @param message 
  */
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
 /**
  * @brief Update the parser's previous and current token, breaking if we hit a TOKEN_ERROR
  */
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if(parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
@@ -144,13 +146,13 @@ static void advance() {
  * @param type 
  * @param message 
  */
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 /**
@@ -158,8 +160,8 @@ static void consume(TokenType type, const char* message) {
  * @param type type to match
  * @return true if they match
  */
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
 /**
@@ -167,19 +169,28 @@ static bool check(TokenType type) {
  * @param type type to check
  * @return true if parser matches, and also advances the parser
  */
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+/**
+ * @brief Emit a 2 byte operand, high byte first.
+ * @param operand 
+ */
+static void emitShort(Parser* parser, uint16_t operand) {
+    emitByte(parser, (operand >> 8) & 0xff);
+    emitByte(parser, operand & 0xff);
 }
 
 /**
@@ -187,24 +198,24 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
  * so the code knows where to jump back to to restart a loop.
  * @param loopStart 
  */
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
     // Placeholder operand for jump. Using backpatching, where we don't know how far 
     // to jump until we get further along with compiling. We replace this placeholder 
     // once we know that.
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
 /**
@@ -212,13 +223,13 @@ static int emitJump(uint8_t instruction) {
  * We return a NIL as the return value, which is "stored" at the top of the stack when done.
  * If we're an initalizer, we return the instance after it's done.
  */
-static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
 
 /**
@@ -226,18 +237,30 @@ static void emitReturn() {
  * @param value constant to add
  * @return the index of where we added the constant
  */
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+}
+
+/**
+ * @brief Give the property instruction just emitted its own inline cache, writing the cache index as a 2 byte operand.
+ */
+static void emitInlineCache(Parser* parser) {
+    int cache = addInlineCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk.");
+    }
+
+    emitShort(parser, (uint16_t)cache);
 }
 
 /**
@@ -245,33 +268,33 @@ static void emitConstant(Value value) {
  * When you see this, think "have the offset passed in be where I want the jump to end up."
  * @param offset 
  */
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start,
-                                             parser.previous.length);
+        parser->compiler->function->name = copyString(parser->vm, parser->previous.start,
+                                             parser->previous.length);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
     // If we have a method, bind 'this' as the name, otherwise leave blank for functions.
@@ -284,50 +307,188 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
-static ObjFunction* endCompiler() {
-    emitReturn();
-    ObjFunction* function = current->function;
+/**
+ * @brief Work out how deep the stack can get in a frame of the function, so call() can make sure the
+ * stack has room for it. Walks the bytecode once, adding up each instruction's stack effect. Forward
+ * jumps record the depth at their target, which is where the walk picks up after an unconditional
+ * jump or a return. Loops jump back to a depth the walk has already seen.
+ */
+static int maxSlots(VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    int* targetDepths = ALLOCATE(vm, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) targetDepths[i] = -1;
+
+    int depth = function->arity + 1;
+    int max = depth;
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count;) {
+        if (targetDepths[offset] > depth || (!reachable && targetDepths[offset] != -1)) {
+            depth = targetDepths[offset];
+        }
+        reachable = true;
+
+        uint8_t* code = &chunk->code[offset];
+        int length = 1;
+        switch (code[0]) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                depth++;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_CLASS:
+                depth++;
+                length = 2;
+                break;
+            case OP_GET_GLOBAL:
+                depth++;
+                length = 3;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_UPVALUE:
+                length = 2;
+                break;
+            case OP_SET_GLOBAL:
+                length = 3;
+                break;
+            case OP_GET_PROPERTY:
+                length = 4;
+                break;
+            case OP_POP:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_PRINT:
+            case OP_CLOSE_UPVALUE:
+            case OP_INHERIT:
+                depth--;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                break;
+            case OP_GET_SUPER:
+            case OP_METHOD:
+                depth--;
+                length = 2;
+                break;
+            case OP_DEFINE_GLOBAL:
+                depth--;
+                length = 3;
+                break;
+            case OP_SET_PROPERTY:
+                depth--;
+                length = 4;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE: {
+                int target = offset + 3 + ((code[1] << 8) | code[2]);
+                // Jumps are left unpatched after a compile error.
+                if (target <= chunk->count && targetDepths[target] < depth) targetDepths[target] = depth;
+                reachable = code[0] != OP_JUMP;
+                length = 3;
+                break;
+            }
+            case OP_LOOP:
+                reachable = false;
+                length = 3;
+                break;
+            case OP_CALL:
+                depth -= code[1];
+                length = 2;
+                break;
+            case OP_INVOKE:
+                depth -= code[2];
+                length = 5;
+                break;
+            case OP_SUPER_INVOKE:
+                depth -= code[2] + 1;
+                length = 3;
+                break;
+            case OP_CLOSURE: {
+                ObjFunction* closed = AS_FUNCTION(chunk->constants.values[code[1]]);
+                depth++;
+                length = 2 + closed->upvalueCount * 2;
+                break;
+            }
+            case OP_RETURN:
+                depth--;
+                reachable = false;
+                break;
+        }
+        if (depth > max) max = depth;
+        offset += length;
+    }
+
+    FREE_ARRAY(vm, int, targetDepths, chunk->count + 1);
+    return max;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    function->maxSlots = maxSlots(parser->vm, function);
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL 
+    if (!parser->hadError) {
+        disassembleChunk(parser->vm, currentChunk(parser), function->name != NULL 
             ? function->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-    current->scopeDepth--;
+static void endScope(Parser* parser) {
+    parser->compiler->scopeDepth--;
 
     // Get rid of all variables at this scope when we leave it.
-    while (current->localCount > 0 &&
-           current->locals[current->localCount -1].depth > current->scopeDepth) {
+    while (parser->compiler->localCount > 0 &&
+           parser->compiler->locals[parser->compiler->localCount -1].depth > parser->compiler->scopeDepth) {
         // As we end a scope, hoist any captured variables onto the heap.
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+        if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
 // Need these due to recursion.
-static void expression();
-static void statement();
-static void declaration();
-static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
+static const ParseRule* getRule(TokenType type);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
+}
+
+/**
+ * @brief Look up the VM's slot for a global variable, so global instructions don't need a hash lookup at runtime.
+ * @param name 
+ * @return index of the global's slot
+ */
+static uint16_t globalVariable(Parser* parser, Token* name) {
+    int slot = globalSlot(parser->vm, copyString(parser->vm, name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -344,13 +505,13 @@ static bool identifiersEqual(Token* a, Token* b) {
  * @param name Name of the variable to search for.
  * @return Index location of variable if found, otherwise -1.
  */
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         // Don't allow var a = a;, even if a is declared in an outer scope.
         if (identifiersEqual(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -359,7 +520,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1; // Assume global variable
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     // If we already have the upvalue, return that early.
@@ -371,7 +532,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -386,21 +547,21 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
  * @param name 
  * @return 
  */
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) return -1;
 
     // If we have a local variable in the enclosing function, capture it.
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         // Mark it needs to be sent to the heap due to closure.
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
     // Otherwise, capture the upvalue of the enclosing function.
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1){
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
@@ -410,12 +571,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
  * @brief Add a local variable to the compiler's 'locals' array.
  * @param name Name of variable to store.
  */
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables to function.");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables to function.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -424,74 +585,75 @@ static void addLocal(Token name) {
 /**
  * @brief Declaring a local variable tells the compiler that a variable exists and track it.
  */
-static void declareVariable() {
-    if (current->scopeDepth == 0 ) return; // Break out of this for global variables. Local only!
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0 ) return; // Break out of this for global variables. Local only!
 
-    Token* name = &parser.previous;
+    Token* name = &parser->previous;
 
     // Don't allow multiple var delcarations for the same variable in the same scope.
-    for (int i = current->localCount - 1; i >= 0; i --) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->localCount - 1; i >= 0; i --) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
 /**
- * @brief Parse a variable, which is the identifier after the var or fun keyword. Store its name in constants table.
+ * @brief Parse a variable, which is the identifier after the var or fun keyword. Look up its global slot.
  * We break early here if we're not doing a global lookup.
  * @param errorMessage 
- * @return index of where the global name was added in constant table
+ * @return index of the global's slot
  */
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static uint16_t parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0 ) return 0;
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0 ) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(parser, &parser->previous);
 }
 
 /**
  * @brief Mark a variable as initialized, setting its depth to the current scope depth.
  */
-static void markInitialized() {
+static void markInitialized(Parser* parser) {
     // If called from a global function, we break early.
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(Parser* parser, uint16_t global) {
     // Break out if we're declaring a local variable.
-    if (current->scopeDepth > 0) {
-        markInitialized();
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(parser, OP_DEFINE_GLOBAL);
+    emitShort(parser, global);
 }
 
 /**
  * @brief returns number of arguments for a function call
 */
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             if (argCount == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             argCount++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
@@ -499,66 +661,69 @@ static uint8_t argumentList() {
  * @brief AND handler. If left operand (already at top of stack) is false, we skip over the right part.
  * @param canAssign 
  */
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
     // If true, evaluate the right side
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
     // If false, end up jumped here and skip over the rest of this function.
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
-    ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+static void binary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
+    const ParseRule* rule = getRule(operatorType);
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(OP_GREATER); break;
+        case TOKEN_BANG_EQUAL:      emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:     emitByte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:         emitByte(parser, OP_GREATER); break;
         // Since we only have EQUAL, LESS, GREATER, we're switching the logic around
         // a >= b  === !(a < b)
-        case TOKEN_GREATER_EQUAL:   emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(OP_LESS); break;
+        case TOKEN_GREATER_EQUAL:   emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:            emitByte(parser, OP_LESS); break;
         // a <= b === !(a > b)
-        case TOKEN_LESS_EQUAL:      emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:            emitByte(OP_ADD); break;
-        case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
+        case TOKEN_LESS_EQUAL:      emitBytes(parser, OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:            emitByte(parser, OP_ADD); break;
+        case TOKEN_MINUS:           emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:            emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:           emitByte(parser, OP_DIVIDE); break;
         default: return; // Unreachable.
     }
 }
 
-static void call(bool canAssign) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
 }
 
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) { // check for '(' after a dot - a method call.
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+        emitInlineCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) { // check for '(' after a dot - a method call.
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+        emitInlineCache(parser);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(parser, OP_GET_PROPERTY, name);
+        emitInlineCache(parser);
     }
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE);
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
+    case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+    case TOKEN_NIL: emitByte(parser, OP_NIL); break;
+    case TOKEN_TRUE: emitByte(parser, OP_TRUE);
     default: return; // Unreachable.
     }
 }
@@ -566,86 +731,93 @@ static void literal(bool canAssign) {
 /**
  * @brief After consuming a (, recurse into expression until we hit )
  */
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 // Get a string, with +1 and -2 removing quotes around the token
-static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1,
+                                    parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1 ) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1 ) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     
     // If we detect a = after the variable name, we're setting, not getting.
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    uint8_t op = getOp;
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        op = setOp;
+    }
+
+    // Global slots take a 2 byte operand, locals and upvalues just one.
+    if (getOp == OP_GET_GLOBAL) {
+        emitByte(parser, op);
+        emitShort(parser, (uint16_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(parser, op, (uint8_t)arg);
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 /**
  * @brief Method used to define the 'this' variable
  * @param canAssign 
  */
-static void this_(bool canAssign) {
+static void this_(Parser* parser, bool canAssign) {
     // Check to see if we're in a class/method.
-    if (currentClass == NULL) {
-        error("Can't use 'this' outside of a class.");
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
 
     // Can't assign this, so pass 'false'.
-    variable(false);
+    variable(parser, false);
 }
 
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // Emit the operator instruction.
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
         default: return; // Unreachable.
     }
 }
@@ -657,29 +829,29 @@ static Token syntheticToken(const char* text) {
     return token;
 }
 
-static void super_(bool canAssign) {
-    if (currentClass == NULL) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
 
     // Get the class that needs to call super.
-    namedVariable(syntheticToken("this"), false);
+    namedVariable(parser, syntheticToken("this"), false);
 
     // Get the super for it, using a superinstruction if called right away.
-    if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
     } else {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
     }
 
 }
@@ -687,7 +859,7 @@ static void super_(bool canAssign) {
 /**
  * @brief Table of token rules to know what prefix and infix functions to call, and what precendence they have
  */
-ParseRule rules[] = {
+static const ParseRule rules[] = {
     [TOKEN_LEFT_PAREN]      =   {grouping,  call,   PREC_CALL},
     [TOKEN_RIGHT_PAREN]     =   {NULL,      NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]      =   {NULL,      NULL,   PREC_NONE},
@@ -735,112 +907,112 @@ ParseRule rules[] = {
  *        Then recurse into infix operators until we're done.
  * @param precedence 
  */
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-static ParseRule* getRule(TokenType type) {
+static const ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name");
+static void varDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expect variable name");
 
     // initializer
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
         // Varables without initializer are nil by default.
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
 /**
  * @brief An expression, followed by a semicolon.
  */
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+static void forStatement(Parser* parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
     // Handle for (;...), for (var x = 1;...), and for (x=1;...)
-    if(match(TOKEN_SEMICOLON)) {
+    if(match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
         // This looks for a semicolon and adds a OP_POP, which we need, over statement()
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
     // Handle for (...;;...) and for (...; x < 5;...)
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is faslse
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
     }
 
     // Handle incrementing. We jump over the increment, run the body, jump back to the increment
     // and run it, then jump to the next iteration. Jumps all the way down.
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         // Emit a loop back to the start of the condition statement
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         // Update loopStart so after we do the main body of the for loop, its jump
         // will end up at the increment expression.
         loopStart = incrementStart;
         // Jumps over the increment expression for now, the body block will bring us back.
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP); // Condition.
     }
-    endScope();
+    endScope(parser);
 }
 
 /**
@@ -852,181 +1024,196 @@ static void forStatement() {
  * If it's true, we pop and do a statement, and jump to the
  * `patchJump(elseJump)` line so we don't do the else as well.
  */
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression(); // Run through the if condition
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser); // Run through the if condition
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE); // If false, skip then.
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE); // If false, skip then.
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP); // Need to jump over else if true.
+    int elseJump = emitJump(parser, OP_JUMP); // Need to jump over else if true.
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
     Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    initCompiler(parser, &compiler, type);
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint16_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
-
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+
+    ObjFunction* function = endCompiler(parser);
+    if (function->upvalueCount == 0 && type == TYPE_FUNCTION) {
+        // Nothing to capture, so the function itself is the value and call() runs it without a closure.
+        emitConstant(parser, OBJ_VAL(function));
+        return;
+    }
+    if (function->upvalueCount == 0) {
+        // Methods are stored as closures. Lox code only ever sees them bound, so every evaluation
+        // of the class can share one closure made now.
+        push(parser->vm, OBJ_VAL(function));
+        ObjClosure* closure = newClosure(parser->vm, function);
+        pop(parser->vm);
+        emitConstant(parser, OBJ_VAL(closure));
+        return;
+    }
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     // OP_CLOSURE's first operand is 1 if the variable is local, 0 for an upvalue
     // the second operand is the index of the variable/upvalue.
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
+    uint16_t global = parser->compiler->scopeDepth > 0 ? 0 : globalVariable(parser, &parser->previous);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, global);
 
     // Add new class to linked list of classes
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
     // Check for superclass clause.
-    if (match(TOKEN_LESS)) {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
         // Load superclass onto stack.
-        variable(false);
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error("A class can't inherit from itself.");
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
 
         // Create a "super" variable so we know which class's super to call.
-        beginScope();
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
         // Load this class onto the stack.
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)){
-        method();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)){
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name");
+static void funDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expect function name");
     // We can mark as initialized now unlike with variables, since we can have
     // function calls in the function definition, to make recursion a thing.
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
     
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
 
-        expression();
-        consume(TOKEN_SEMICOLON,"Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON,"Expect ';' after return value.");
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'." );
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'." );
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -1041,61 +1228,68 @@ static void synchronize() {
                 ; // Do nothing.
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration() {
-    if (match(TOKEN_CLASS)) {
-        classDeclaration();
-    } else if (match(TOKEN_FUN)) {
-        funDeclaration();
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
     // Synchronize if we hit error parsing previous statement.
-    if (parser.panicMode) synchronize();
-
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+    if (parser->panicMode) synchronize(parser);
+
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser;
+    parser.vm = vm;
+    initScanner(&parser.scanner, source);
     parser.hadError = false;
     parser.panicMode = false;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
+    // Lets the GC find the functions being compiled.
+    vm->parser = &parser;
+
+    Compiler compiler;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
-    advance();
+    advance(&parser);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
     
-    ObjFunction* function = endCompiler();
+    ObjFunction* function = endCompiler(&parser);
+    vm->parser = NULL;
 
     // Return false if error occured
     return parser.hadError ? NULL : function;
@@ -1104,10 +1298,10 @@ ObjFunction* compile(const char* source) {
 /**
  * @brief Mark anything the compiler is using when GC'ing
  */
-void markCompilerRoots() {
-    Compiler* compiler = current;
+void markCompilerRoots(VM* vm) {
+    Compiler* compiler = vm->parser == NULL ? NULL : vm->parser->compiler;
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        markObject(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 /**
  * @brief Print the name of a chunk and disassemble its instructions
@@ -10,10 +11,10 @@
  * @param name The name of the chunk
 
  */
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
@@ -32,6 +33,38 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+/**
+ * @brief Print a global variable instruction - its slot and the name of the global in it
+ * @param name Name of the instruction
+ * @param chunk Bytecode to read
+ * @param offset offset to read in the bytecode
+ * @return offset value + 3 (1 for opcode, 2 for the slot)
+ */
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/**
+ * @brief Print a property instruction - its name constant and the inline cache it uses
+ * @param name Name of the instruction
+ * @param chunk Bytecode to read
+ * @param offset offset to read in the bytecode
+ * @return offset value + 4 (1 for opcode, 1 for the constant, 2 for the cache)
+ */
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
 /**
  * @brief Superinstruction for OP_GET_PROPERTY and OP_CALL, for method calls.
  * @param name 
@@ -48,6 +81,19 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+/**
+ * @brief OP_INVOKE, which is an invokeInstruction() followed by its inline cache index.
+ */
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
 /**
  * @brief Print the instruction name used
  * @param name Instruction name to print
@@ -79,7 +125,7 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
  * @param offset Where to start reading in the bytecode, in bytes
  * @return updated offset value past the just dissassembled instruction
  */
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && 
         chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -105,19 +151,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -149,7 +195,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
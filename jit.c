@@ -0,0 +1,928 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+
+#ifdef BASELINE_JIT
+
+#include <sys/mman.h>
+
+/*
+ * Baseline template JIT. Every bytecode instruction is translated on its own to a fixed
+ * x86-64 template. The VM's value stack stays the source of truth, so compiled code and
+ * run() can hand a frame back and forth at any instruction boundary. While compiled code
+ * runs it keeps the interpreter's locals in callee saved registers:
+ *
+ *   r13 - CallFrame* of the function
+ *   rbx - frame->slots
+ *   r12 - stackTop, written back to vm->stackTop before calling into the VM
+ *   r14 - the chunk's constant table
+ *   r15 - VM* the code is running in, passed to the entry stub
+ *
+ * Numbers, locals, globals, upvalues, comparisons and jumps are done inline. Everything that
+ * can allocate, call, or report an error calls one of the jit* helpers in vm.c. The generated
+ * code never holds on to heap objects - it reloads its registers from the frame after every
+ * helper, since a helper can run the GC. Loops and calls are safepoints like they are in run(),
+ * checking for a requested minor GC, which can move young objects.
+ */
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+typedef enum {
+    XMM0, XMM1
+} XmmRegister;
+
+// Condition codes, as used by jcc and setcc.
+typedef enum {
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_NP = 0xb,
+    CC_ALWAYS = -1, //< Not a real condition, makes jump() emit a plain jmp.
+} Condition;
+
+// Opcode extensions and opcodes for the integer instructions we use.
+#define ALU_ADD 0
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+#define OP_ADD_RR 0x01
+#define OP_AND_RR 0x21
+#define OP_XOR_RR 0x31
+#define OP_CMP_RR 0x39
+#define OP_TEST_RR 0x85
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+/**
+ * @brief Jump whose 32 bit displacement gets filled in once every instruction has been emitted.
+ */
+typedef struct {
+    int position; //< Offset of the displacement in the code.
+    int target; //< Bytecode offset of the instruction to jump to.
+} JumpPatch;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    JumpPatch* patches;
+    int patchCount;
+    int patchCapacity;
+    VM* vm; //< VM the buffers are allocated in.
+    uint32_t* offsets; //< Native offset of each bytecode instruction emitted so far.
+    int errorExit; //< Offset of the code returning false to the caller.
+    int normalExit; //< Offset of the code returning the value in eax to the caller.
+} Assembler;
+
+typedef bool (*JitEntry)(VM* vm, CallFrame* frame, uint8_t* start);
+
+static void emit8(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(as->vm, uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void patch32(Assembler* as, int position, int32_t value) {
+    for (int i = 0; i < 4; i++) as->code[position + i] = ((uint32_t)value >> (i * 8)) & 0xff;
+}
+
+/**
+ * @brief Emit a REX prefix if the instruction needs one.
+ * @param as
+ * @param wide true for a 64 bit operation
+ * @param reg register in the ModRM reg field
+ * @param rm register in the ModRM rm field
+ */
+static void emitRex(Assembler* as, bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) emit8(as, rex);
+}
+
+// ModRM for a register to register operation.
+static void emitDirect(Assembler* as, int reg, int rm) {
+    emit8(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// ModRM for [base + disp32]. rsp and r12 as a base need a SIB byte.
+static void emitIndirect(Assembler* as, int reg, Register base, int32_t disp) {
+    emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit8(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void load(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, true, dst, base);
+    emit8(as, 0x8b);
+    emitIndirect(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void store(Assembler* as, Register base, int32_t disp, Register src) {
+    emitRex(as, true, src, base);
+    emit8(as, 0x89);
+    emitIndirect(as, src, base, disp);
+}
+
+// mov dst32, [base + disp]
+static void load32(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, false, dst, base);
+    emit8(as, 0x8b);
+    emitIndirect(as, dst, base, disp);
+}
+
+// movzx dst32, byte [base + disp]
+static void load8(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, false, dst, base);
+    emit8(as, 0x0f);
+    emit8(as, 0xb6);
+    emitIndirect(as, dst, base, disp);
+}
+
+// mov [base + disp], src32
+static void store32(Assembler* as, Register base, int32_t disp, Register src) {
+    emitRex(as, false, src, base);
+    emit8(as, 0x89);
+    emitIndirect(as, src, base, disp);
+}
+
+// lea dst, [base + disp]
+static void lea(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, true, dst, base);
+    emit8(as, 0x8d);
+    emitIndirect(as, dst, base, disp);
+}
+
+// mov dst, src
+static void move(Assembler* as, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emit8(as, 0x89);
+    emitDirect(as, src, dst);
+}
+
+// mov dst, imm64. Small values use the shorter zero extending 32 bit move.
+static void moveImmediate(Assembler* as, Register dst, uint64_t value) {
+    if (value <= UINT32_MAX) {
+        emitRex(as, false, 0, dst);
+        emit8(as, 0xb8 + (dst & 7));
+        emit32(as, (uint32_t)value);
+        return;
+    }
+    emitRex(as, true, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit64(as, value);
+}
+
+// add/and/sub/cmp reg, imm32
+static void aluImmediate(Assembler* as, int operation, Register reg, int32_t value) {
+    emitRex(as, true, 0, reg);
+    emit8(as, 0x81);
+    emitDirect(as, operation, reg);
+    emit32(as, (uint32_t)value);
+}
+
+// add/and/xor/cmp/test dst, src
+static void aluRegister(Assembler* as, uint8_t opcode, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emit8(as, opcode);
+    emitDirect(as, src, dst);
+}
+
+// movq xmm, reg
+static void moveToXmm(Assembler* as, XmmRegister dst, Register src) {
+    emit8(as, 0x66);
+    emitRex(as, true, dst, src);
+    emit8(as, 0x0f);
+    emit8(as, 0x6e);
+    emitDirect(as, dst, src);
+}
+
+// movq reg, xmm
+static void moveFromXmm(Assembler* as, Register dst, XmmRegister src) {
+    emit8(as, 0x66);
+    emitRex(as, true, src, dst);
+    emit8(as, 0x0f);
+    emit8(as, 0x7e);
+    emitDirect(as, src, dst);
+}
+
+// addsd/subsd/mulsd/divsd dst, src
+static void sseArithmetic(Assembler* as, uint8_t opcode, XmmRegister dst, XmmRegister src) {
+    emit8(as, 0xf2);
+    emit8(as, 0x0f);
+    emit8(as, opcode);
+    emitDirect(as, dst, src);
+}
+
+// ucomisd a, b
+static void sseCompare(Assembler* as, XmmRegister a, XmmRegister b) {
+    emit8(as, 0x66);
+    emit8(as, 0x0f);
+    emit8(as, 0x2e);
+    emitDirect(as, a, b);
+}
+
+// setcc on the low byte of rax, rcx, rdx or rbx.
+static void setCondition(Assembler* as, Condition condition, Register reg) {
+    emit8(as, 0x0f);
+    emit8(as, 0x90 + condition);
+    emitDirect(as, 0, reg);
+}
+
+static void push64(Assembler* as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emit8(as, 0x50 + (reg & 7));
+}
+
+static void pop64(Assembler* as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emit8(as, 0x58 + (reg & 7));
+}
+
+/**
+ * @brief Emit a jump with a displacement to fill in later.
+ * @param as
+ * @param condition condition to jump on, or CC_ALWAYS
+ * @return offset of the displacement
+ */
+static int jump(Assembler* as, Condition condition) {
+    if (condition == CC_ALWAYS) {
+        emit8(as, 0xe9);
+    } else {
+        emit8(as, 0x0f);
+        emit8(as, 0x80 + condition);
+    }
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// Point a jump from jump() at the next instruction emitted.
+static void patchJumpHere(Assembler* as, int position) {
+    patch32(as, position, as->count - (position + 4));
+}
+
+// Emit a jump to code that's already been emitted.
+static void jumpTo(Assembler* as, Condition condition, int target) {
+    int position = jump(as, condition);
+    patch32(as, position, target - (position + 4));
+}
+
+// Emit a jump to the code for a bytecode instruction, which might not have been emitted yet.
+static void jumpToInstruction(Assembler* as, Condition condition, int target) {
+    if (as->patchCapacity < as->patchCount + 1) {
+        int oldCapacity = as->patchCapacity;
+        as->patchCapacity = GROW_CAPACITY(oldCapacity);
+        as->patches = GROW_ARRAY(as->vm, JumpPatch, as->patches, oldCapacity, as->patchCapacity);
+    }
+    as->patches[as->patchCount].position = jump(as, condition);
+    as->patches[as->patchCount].target = target;
+    as->patchCount++;
+}
+
+// Call one of the jit* helpers. They all take the VM first, so it goes in rdi here and the
+// helper's own arguments go in rsi, rdx, rcx and r8.
+static void callFunction(Assembler* as, void* function) {
+    move(as, RDI, R15);
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    emit8(as, 0xff);
+    emitDirect(as, 2, RAX); // call rax
+}
+
+// The operations the templates are built from.
+
+static void pushValue(Assembler* as, Register reg) {
+    store(as, R12, 0, reg);
+    aluImmediate(as, ALU_ADD, R12, sizeof(Value));
+}
+
+static void loadConstants(Assembler* as) {
+    load(as, RAX, R13, offsetof(CallFrame, function));
+    load(as, R14, RAX, offsetof(ObjFunction, chunk.constants.values));
+}
+
+/**
+ * @brief Write the state the VM needs back before calling a helper. Sets the frame's ip just
+ * past the current instruction, which is what runtimeError() expects.
+ * @param as
+ * @param next bytecode offset of the next instruction
+ */
+static void saveState(Assembler* as, int next) {
+    store(as, R15, offsetof(VM, stackTop), R12);
+    load(as, RAX, R13, offsetof(CallFrame, function));
+    load(as, RAX, RAX, offsetof(ObjFunction, chunk.code));
+    aluImmediate(as, ALU_ADD, RAX, next);
+    store(as, R13, offsetof(CallFrame, ip), RAX);
+}
+
+// Reload everything a helper could have changed.
+static void restoreState(Assembler* as) {
+    load(as, R12, R15, offsetof(VM, stackTop));
+    load(as, RBX, R13, offsetof(CallFrame, slots));
+    loadConstants(as);
+}
+
+// Leave the compiled code if the helper just called reported an error.
+static void checkResult(Assembler* as) {
+    emit8(as, 0x84);
+    emitDirect(as, RAX, RAX); // test al, al
+    jumpTo(as, CC_E, as->errorExit);
+}
+
+/**
+ * @brief Run a minor GC here if one has been asked for, same as SAFEPOINT() in run().
+ * @param as
+ * @param next bytecode offset of the next instruction
+ */
+static void safepoint(Assembler* as, int next) {
+    load8(as, RAX, R15, offsetof(VM, minorGCRequested));
+    aluRegister(as, OP_TEST_RR, RAX, RAX);
+    int notRequested = jump(as, CC_E);
+    saveState(as, next);
+    callFunction(as, jitSafepoint);
+    restoreState(as);
+    patchJumpHere(as, notRequested);
+}
+
+// Write barrier for a store into a global. Only does anything while the full GC is marking.
+static void globalWriteBarrier(Assembler* as, Register value) {
+    load32(as, RCX, R15, offsetof(VM, gcState));
+    aluImmediate(as, ALU_CMP, RCX, GC_MARKING);
+    int notMarking = jump(as, CC_NE);
+    move(as, RDX, value);
+    moveImmediate(as, RSI, 0);
+    callFunction(as, jitWriteBarrier);
+    patchJumpHere(as, notMarking);
+}
+
+// Report a runtime error and leave.
+static void emitError(Assembler* as, int next, const char* message) {
+    saveState(as, next);
+    moveImmediate(as, RSI, (uint64_t)(uintptr_t)message);
+    callFunction(as, jitError);
+    jumpTo(as, CC_ALWAYS, as->errorExit);
+}
+
+// Jump to target if the value in reg isn't a number. Clobbers rsi, needs QNAN in rdx.
+static void jumpIfNotNumber(Assembler* as, Register reg, int* position) {
+    move(as, RSI, reg);
+    aluRegister(as, OP_AND_RR, RSI, RDX);
+    aluRegister(as, OP_CMP_RR, RSI, RDX);
+    *position = jump(as, CC_E);
+}
+
+// Jump to target if the value in reg isn't an object. Clobbers rsi, needs SIGN_BIT | QNAN in rdx.
+static void jumpIfNotObject(Assembler* as, Register reg, int* position) {
+    move(as, RSI, reg);
+    aluRegister(as, OP_AND_RR, RSI, RDX);
+    aluRegister(as, OP_CMP_RR, RSI, RDX);
+    *position = jump(as, CC_NE);
+}
+
+// Turn the flag in al into TRUE_VAL or FALSE_VAL in rax.
+static void boolFromFlag(Assembler* as) {
+    emit8(as, 0x0f);
+    emit8(as, 0xb6);
+    emitDirect(as, RAX, RAX); // movzx eax, al
+    moveImmediate(as, RCX, FALSE_VAL);
+    aluRegister(as, OP_ADD_RR, RAX, RCX);
+}
+
+/**
+ * @brief Load the two operands of a binary instruction into rax and rcx, and the same bits into
+ * xmm0 and xmm1, jumping off to a slow path if either isn't a number.
+ * @param as
+ * @param slowPaths set to the two jumps to the slow path
+ */
+static void loadNumberOperands(Assembler* as, int slowPaths[2]) {
+    load(as, RAX, R12, -2 * (int32_t)sizeof(Value));
+    load(as, RCX, R12, -(int32_t)sizeof(Value));
+    moveImmediate(as, RDX, QNAN);
+    jumpIfNotNumber(as, RAX, &slowPaths[0]);
+    jumpIfNotNumber(as, RCX, &slowPaths[1]);
+    moveToXmm(as, XMM0, RAX);
+    moveToXmm(as, XMM1, RCX);
+}
+
+static void arithmetic(Assembler* as, uint8_t operation, int next) {
+    int slowPaths[2];
+    loadNumberOperands(as, slowPaths);
+    sseArithmetic(as, operation, XMM0, XMM1);
+    moveFromXmm(as, RAX, XMM0);
+    aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+    store(as, R12, -(int32_t)sizeof(Value), RAX);
+    int done = jump(as, CC_ALWAYS);
+
+    patchJumpHere(as, slowPaths[0]);
+    patchJumpHere(as, slowPaths[1]);
+    if (operation == SSE_ADD) {
+        // Could be two strings.
+        saveState(as, next);
+        callFunction(as, jitAdd);
+        checkResult(as);
+        restoreState(as);
+    } else {
+        emitError(as, next, "Operands must be numbers.");
+    }
+    patchJumpHere(as, done);
+}
+
+static void comparison(Assembler* as, bool greater, int next) {
+    int slowPaths[2];
+    loadNumberOperands(as, slowPaths);
+    // Compare so "above" is the answer. Unordered (NaN) operands aren't above anything.
+    if (greater) {
+        sseCompare(as, XMM0, XMM1);
+    } else {
+        sseCompare(as, XMM1, XMM0);
+    }
+    setCondition(as, CC_A, RAX);
+    boolFromFlag(as);
+    aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+    store(as, R12, -(int32_t)sizeof(Value), RAX);
+    int done = jump(as, CC_ALWAYS);
+
+    patchJumpHere(as, slowPaths[0]);
+    patchJumpHere(as, slowPaths[1]);
+    emitError(as, next, "Operands must be numbers.");
+    patchJumpHere(as, done);
+}
+
+// Same as valuesEqual(): numbers compare as doubles so NaN != NaN, everything else by its bits.
+static void equal(Assembler* as, int next) {
+    int bitwise[2];
+    loadNumberOperands(as, bitwise);
+    sseCompare(as, XMM0, XMM1);
+    setCondition(as, CC_E, RAX);
+    setCondition(as, CC_NP, RCX);
+    emit8(as, 0x20);
+    emitDirect(as, RCX, RAX); // and al, cl
+    int done = jump(as, CC_ALWAYS);
+
+    patchJumpHere(as, bitwise[0]);
+    patchJumpHere(as, bitwise[1]);
+    aluRegister(as, OP_CMP_RR, RAX, RCX);
+    setCondition(as, CC_E, RAX);
+    int same = jump(as, CC_E);
+
+    // Two different objects can still be equal strings if either is a rope, flatten them and look again.
+    int notObject[2];
+    moveImmediate(as, RDX, SIGN_BIT | QNAN);
+    jumpIfNotObject(as, RAX, &notObject[0]);
+    jumpIfNotObject(as, RCX, &notObject[1]);
+    saveState(as, next);
+    callFunction(as, jitFlattenOperands);
+    restoreState(as);
+    load(as, RAX, R12, -2 * (int32_t)sizeof(Value));
+    load(as, RCX, R12, -(int32_t)sizeof(Value));
+    aluRegister(as, OP_CMP_RR, RAX, RCX);
+    setCondition(as, CC_E, RAX);
+
+    patchJumpHere(as, notObject[0]);
+    patchJumpHere(as, notObject[1]);
+    patchJumpHere(as, same);
+    patchJumpHere(as, done);
+    boolFromFlag(as);
+    aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+    store(as, R12, -(int32_t)sizeof(Value), RAX);
+}
+
+// Load the ObjUpvalue* for upvalue slot into rax.
+static void loadUpvalue(Assembler* as, int slot) {
+    load(as, RAX, R13, offsetof(CallFrame, closure));
+    load(as, RAX, RAX, offsetof(ObjClosure, upvalues) + slot * (int32_t)sizeof(ObjUpvalue*));
+    load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+// Load the global values array into rdx and the value in slot into rax, erroring if it's undefined.
+static void loadGlobal(Assembler* as, int slot, int next) {
+    load(as, RDX, R15, offsetof(VM, globalValues.values));
+    load(as, RAX, RDX, slot * (int32_t)sizeof(Value));
+    moveImmediate(as, RCX, UNDEFINED_VAL);
+    aluRegister(as, OP_CMP_RR, RAX, RCX);
+    int defined = jump(as, CC_NE);
+    saveState(as, next);
+    moveImmediate(as, RSI, slot);
+    callFunction(as, jitUndefinedVariable);
+    jumpTo(as, CC_ALWAYS, as->errorExit);
+    patchJumpHere(as, defined);
+}
+
+// Give the value on top of the stack an ObjBoundMethod if it's lazily bound, before it gets stored off the stack.
+static void materializeTop(Assembler* as, int next) {
+    load(as, RAX, R12, -(int32_t)sizeof(Value));
+    moveImmediate(as, RCX, SIGN_BIT | QNAN | TAG_LAZY_BOUND);
+    aluRegister(as, OP_AND_RR, RAX, RCX);
+    moveImmediate(as, RCX, QNAN | TAG_LAZY_BOUND);
+    aluRegister(as, OP_CMP_RR, RAX, RCX);
+    int notLazy = jump(as, CC_NE);
+    saveState(as, next);
+    callFunction(as, jitMaterializeTop);
+    restoreState(as);
+    patchJumpHere(as, notLazy);
+}
+
+static void returnFromFunction(Assembler* as) {
+    // Close upvalues pointing into the frame, if there are any.
+    load(as, RCX, R15, offsetof(VM, openUpvalues));
+    aluRegister(as, OP_TEST_RR, RCX, RCX);
+    int noUpvalues = jump(as, CC_E);
+    load(as, RCX, RCX, offsetof(ObjUpvalue, location));
+    aluRegister(as, OP_CMP_RR, RCX, RBX);
+    int belowFrame = jump(as, CC_B);
+    store(as, R15, offsetof(VM, stackTop), R12);
+    move(as, RSI, RBX);
+    callFunction(as, jitCloseUpvalues);
+    patchJumpHere(as, noUpvalues);
+    patchJumpHere(as, belowFrame);
+
+    // Pop the frame and leave the result where the callee was.
+    load32(as, RAX, R15, offsetof(VM, frameCount));
+    emit8(as, 0x83);
+    emitDirect(as, ALU_SUB, RAX);
+    emit8(as, 1); // sub eax, 1
+    store32(as, R15, offsetof(VM, frameCount), RAX);
+    load(as, RAX, R12, -(int32_t)sizeof(Value));
+    store(as, RBX, 0, RAX);
+    lea(as, RAX, RBX, sizeof(Value));
+    store(as, R15, offsetof(VM, stackTop), RAX);
+    moveImmediate(as, RAX, 1);
+    jumpTo(as, CC_ALWAYS, as->normalExit);
+}
+
+/**
+ * @brief Emit the entry stub and the shared exits.
+ * The stub is called as a JitEntry - it sets up the registers for the VM in rdi and the frame
+ * in rsi, and jumps to the instruction in rdx.
+ */
+static void emitEntry(Assembler* as) {
+    push64(as, RBP);
+    move(as, RBP, RSP);
+    push64(as, RBX);
+    push64(as, R12);
+    push64(as, R13);
+    push64(as, R14);
+    push64(as, R15);
+    aluImmediate(as, ALU_SUB, RSP, 8); // Keep the stack 16 byte aligned for calls.
+
+    move(as, R15, RDI);
+    move(as, R13, RSI);
+    restoreState(as);
+    emit8(as, 0xff);
+    emitDirect(as, 4, RDX); // jmp rdx
+
+    as->errorExit = as->count;
+    moveImmediate(as, RAX, 0);
+    as->normalExit = as->count;
+    aluImmediate(as, ALU_ADD, RSP, 8);
+    pop64(as, R15);
+    pop64(as, R14);
+    pop64(as, R13);
+    pop64(as, R12);
+    pop64(as, RBX);
+    pop64(as, RBP);
+    emit8(as, 0xc3); // ret
+}
+
+/**
+ * @brief Emit the template for one instruction.
+ * @param as
+ * @param chunk chunk being compiled
+ * @param offset bytecode offset of the instruction
+ * @return bytecode offset of the next instruction, or -1 if the instruction can't be compiled
+ */
+static int emitInstruction(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code;
+    uint8_t instruction = code[offset];
+#define BYTE(n) (code[offset + (n)])
+#define SHORT(n) ((uint16_t)((code[offset + (n)] << 8) | code[offset + (n) + 1]))
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            load(as, RAX, R14, BYTE(1) * (int32_t)sizeof(Value));
+            pushValue(as, RAX);
+            return offset + 2;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            moveImmediate(as, RAX, instruction == OP_NIL ? NIL_VAL : BOOL_VAL(instruction == OP_TRUE));
+            pushValue(as, RAX);
+            return offset + 1;
+        case OP_POP:
+            aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+            return offset + 1;
+        case OP_GET_LOCAL:
+            load(as, RAX, RBX, BYTE(1) * (int32_t)sizeof(Value));
+            pushValue(as, RAX);
+            return offset + 2;
+        case OP_SET_LOCAL:
+            load(as, RAX, R12, -(int32_t)sizeof(Value));
+            store(as, RBX, BYTE(1) * (int32_t)sizeof(Value), RAX);
+            return offset + 2;
+        case OP_GET_GLOBAL:
+            loadGlobal(as, SHORT(1), offset + 3);
+            pushValue(as, RAX);
+            return offset + 3;
+        case OP_DEFINE_GLOBAL:
+            materializeTop(as, offset + 3);
+            load(as, RDX, R15, offsetof(VM, globalValues.values));
+            aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+            load(as, RAX, R12, 0);
+            store(as, RDX, SHORT(1) * (int32_t)sizeof(Value), RAX);
+            globalWriteBarrier(as, RAX);
+            return offset + 3;
+        case OP_SET_GLOBAL:
+            materializeTop(as, offset + 3);
+            loadGlobal(as, SHORT(1), offset + 3);
+            load(as, RAX, R12, -(int32_t)sizeof(Value));
+            store(as, RDX, SHORT(1) * (int32_t)sizeof(Value), RAX);
+            globalWriteBarrier(as, RAX);
+            return offset + 3;
+        case OP_GET_UPVALUE:
+            loadUpvalue(as, BYTE(1));
+            load(as, RAX, RAX, 0);
+            pushValue(as, RAX);
+            return offset + 2;
+        case OP_SET_UPVALUE: {
+            materializeTop(as, offset + 2);
+            loadUpvalue(as, BYTE(1));
+            load(as, RSI, R12, -(int32_t)sizeof(Value));
+            store(as, RAX, 0, RSI);
+            // Write barrier, only needed when storing an object.
+            moveImmediate(as, RCX, SIGN_BIT | QNAN);
+            move(as, RDX, RSI);
+            aluRegister(as, OP_AND_RR, RDX, RCX);
+            aluRegister(as, OP_CMP_RR, RDX, RCX);
+            int notObject = jump(as, CC_NE);
+            move(as, RDX, RSI);
+            load(as, RSI, R13, offsetof(CallFrame, closure));
+            load(as, RSI, RSI, offsetof(ObjClosure, upvalues) + BYTE(1) * (int32_t)sizeof(ObjUpvalue*));
+            callFunction(as, jitWriteBarrier);
+            patchJumpHere(as, notObject);
+            return offset + 2;
+        }
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            saveState(as, offset + 4);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, BYTE(1));
+            moveImmediate(as, RCX, SHORT(2));
+            callFunction(as, instruction == OP_GET_PROPERTY ? (void*)jitGetProperty : (void*)jitSetProperty);
+            checkResult(as);
+            restoreState(as);
+            return offset + 4;
+        case OP_GET_SUPER:
+            saveState(as, offset + 2);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, BYTE(1));
+            callFunction(as, jitGetSuper);
+            checkResult(as);
+            restoreState(as);
+            return offset + 2;
+        case OP_EQUAL:    equal(as, offset + 1); return offset + 1;
+        case OP_GREATER:  comparison(as, true, offset + 1); return offset + 1;
+        case OP_LESS:     comparison(as, false, offset + 1); return offset + 1;
+        case OP_ADD:      arithmetic(as, SSE_ADD, offset + 1); return offset + 1;
+        case OP_SUBTRACT: arithmetic(as, SSE_SUB, offset + 1); return offset + 1;
+        case OP_MULTIPLY: arithmetic(as, SSE_MUL, offset + 1); return offset + 1;
+        case OP_DIVIDE:   arithmetic(as, SSE_DIV, offset + 1); return offset + 1;
+        case OP_NOT:
+            // Only nil and false are falsey.
+            load(as, RDX, R12, -(int32_t)sizeof(Value));
+            moveImmediate(as, RCX, NIL_VAL);
+            aluRegister(as, OP_CMP_RR, RDX, RCX);
+            setCondition(as, CC_E, RAX);
+            moveImmediate(as, RCX, FALSE_VAL);
+            aluRegister(as, OP_CMP_RR, RDX, RCX);
+            setCondition(as, CC_E, RCX);
+            emit8(as, 0x08);
+            emitDirect(as, RCX, RAX); // or al, cl
+            boolFromFlag(as);
+            store(as, R12, -(int32_t)sizeof(Value), RAX);
+            return offset + 1;
+        case OP_NEGATE: {
+            load(as, RAX, R12, -(int32_t)sizeof(Value));
+            moveImmediate(as, RDX, QNAN);
+            int notNumber;
+            jumpIfNotNumber(as, RAX, &notNumber);
+            moveImmediate(as, RCX, SIGN_BIT);
+            aluRegister(as, OP_XOR_RR, RAX, RCX);
+            store(as, R12, -(int32_t)sizeof(Value), RAX);
+            int done = jump(as, CC_ALWAYS);
+            patchJumpHere(as, notNumber);
+            emitError(as, offset + 1, "Opearand must be a number.");
+            patchJumpHere(as, done);
+            return offset + 1;
+        }
+        case OP_PRINT:
+            saveState(as, offset + 1);
+            callFunction(as, jitPrint);
+            restoreState(as);
+            return offset + 1;
+        case OP_JUMP:
+            jumpToInstruction(as, CC_ALWAYS, offset + 3 + SHORT(1));
+            return offset + 3;
+        case OP_JUMP_IF_FALSE:
+            load(as, RAX, R12, -(int32_t)sizeof(Value));
+            moveImmediate(as, RCX, NIL_VAL);
+            aluRegister(as, OP_CMP_RR, RAX, RCX);
+            jumpToInstruction(as, CC_E, offset + 3 + SHORT(1));
+            moveImmediate(as, RCX, FALSE_VAL);
+            aluRegister(as, OP_CMP_RR, RAX, RCX);
+            jumpToInstruction(as, CC_E, offset + 3 + SHORT(1));
+            return offset + 3;
+        case OP_LOOP:
+            safepoint(as, offset + 3);
+            jumpToInstruction(as, CC_ALWAYS, offset + 3 - SHORT(1));
+            return offset + 3;
+        case OP_CALL:
+            safepoint(as, offset + 2);
+            saveState(as, offset + 2);
+            moveImmediate(as, RSI, BYTE(1));
+            callFunction(as, jitCall);
+            checkResult(as);
+            restoreState(as);
+            return offset + 2;
+        case OP_INVOKE:
+            safepoint(as, offset + 5);
+            saveState(as, offset + 5);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, BYTE(1));
+            moveImmediate(as, RCX, BYTE(2));
+            moveImmediate(as, R8, SHORT(3));
+            callFunction(as, jitInvoke);
+            checkResult(as);
+            restoreState(as);
+            return offset + 5;
+        case OP_SUPER_INVOKE:
+            safepoint(as, offset + 3);
+            saveState(as, offset + 3);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, BYTE(1));
+            moveImmediate(as, RCX, BYTE(2));
+            callFunction(as, jitSuperInvoke);
+            checkResult(as);
+            restoreState(as);
+            return offset + 3;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[BYTE(1)]);
+            int next = offset + 2 + function->upvalueCount * 2;
+            saveState(as, next);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, offset + 1);
+            callFunction(as, jitClosure);
+            restoreState(as);
+            return next;
+        }
+        case OP_CLOSE_UPVALUE:
+            store(as, R15, offsetof(VM, stackTop), R12);
+            lea(as, RSI, R12, -(int32_t)sizeof(Value));
+            callFunction(as, jitCloseUpvalues);
+            aluImmediate(as, ALU_SUB, R12, sizeof(Value));
+            return offset + 1;
+        case OP_RETURN:
+            returnFromFunction(as);
+            return offset + 1;
+        case OP_CLASS:
+        case OP_METHOD:
+            saveState(as, offset + 2);
+            move(as, RSI, R13);
+            moveImmediate(as, RDX, BYTE(1));
+            callFunction(as, instruction == OP_CLASS ? (void*)jitClass : (void*)jitMethod);
+            restoreState(as);
+            return offset + 2;
+        case OP_INHERIT:
+            saveState(as, offset + 1);
+            callFunction(as, jitInherit);
+            checkResult(as);
+            restoreState(as);
+            return offset + 1;
+        default:
+            return -1;
+    }
+#undef BYTE
+#undef SHORT
+}
+
+static void freeAssembler(Assembler* as, int offsetCount) {
+    FREE_ARRAY(as->vm, uint8_t, as->code, as->capacity);
+    FREE_ARRAY(as->vm, JumpPatch, as->patches, as->patchCapacity);
+    FREE_ARRAY(as->vm, uint32_t, as->offsets, offsetCount);
+}
+
+/**
+ * @brief Compile a function's bytecode to native code, setting function->jit if it works.
+ * Can allocate, so the function has to be reachable by the GC.
+ * @param vm VM the function belongs to
+ * @param function
+ * @return false if the function couldn't be compiled
+ */
+bool jitCompile(VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Assembler as;
+    as.vm = vm;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.patches = NULL;
+    as.patchCount = 0;
+    as.patchCapacity = 0;
+    as.offsets = ALLOCATE(vm, uint32_t, chunk->count);
+
+    emitEntry(&as);
+    for (int offset = 0; offset < chunk->count;) {
+        as.offsets[offset] = as.count;
+        offset = emitInstruction(&as, chunk, offset);
+        if (offset < 0) {
+            freeAssembler(&as, chunk->count);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < as.patchCount; i++) {
+        JumpPatch* patch = &as.patches[i];
+        patch32(&as, patch->position, (int32_t)as.offsets[patch->target] - (patch->position + 4));
+    }
+
+    // Copy the code into its own mapping, then make it executable instead of writable.
+    size_t size = ((size_t)as.count + 4095) & ~(size_t)4095;
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        freeAssembler(&as, chunk->count);
+        return false;
+    }
+    memcpy(code, as.code, as.count);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        freeAssembler(&as, chunk->count);
+        return false;
+    }
+
+    JitCode* jit = ALLOCATE(vm, JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->offsets = as.offsets;
+    jit->offsetCount = chunk->count;
+    as.offsets = NULL;
+    freeAssembler(&as, 0);
+
+    function->jit = jit;
+    return true;
+}
+
+/**
+ * @brief Run a frame in compiled code until its function returns.
+ * On return the frame has been popped and the result is on the stack, same as OP_RETURN.
+ * @param vm VM the frame is on
+ * @param frame frame of a function that has been compiled
+ * @param ip instruction to start at, NULL for the start of the function
+ * @return false if there was a runtime error
+ */
+bool jitEnter(VM* vm, CallFrame* frame, uint8_t* ip) {
+    ObjFunction* function = frame->function;
+    JitCode* jit = function->jit;
+    int offset = ip == NULL ? 0 : (int)(ip - function->chunk.code);
+    JitEntry entry = (JitEntry)(void*)jit->code;
+    vm->jitNesting++;
+    bool ok = entry(vm, frame, jit->code + jit->offsets[offset]);
+    vm->jitNesting--;
+    return ok;
+}
+
+/**
+ * @brief Free a function's native code, if it has any.
+ * @param vm VM the function belongs to
+ * @param function
+ */
+void jitFree(VM* vm, ObjFunction* function) {
+    JitCode* jit = function->jit;
+    if (jit == NULL) return;
+
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(vm, uint32_t, jit->offsets, jit->offsetCount);
+    FREE(vm, JitCode, jit);
+    function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// How many calls and loop back edges a function runs in the interpreter before it gets compiled.
+#define JIT_THRESHOLD 1000
+
+// How deep jitEnter() calls can nest on the C stack. Frames called past that get interpreted instead.
+#define JIT_NESTING_MAX 1000
+
+/**
+ * @brief Native x86-64 code compiled from a function's bytecode.
+ * The code runs the function until it returns, working on the VM's value stack just like run() does,
+ * so it can be entered at the start of the function or, part way through, at any instruction.
+ */
+struct JitCode {
+    uint8_t* code; //< Executable mapping. Starts with the entry stub, the function body follows.
+    size_t size; //< Size of the mapping in bytes.
+    uint32_t* offsets; //< Offset in code of each instruction, indexed by the instruction's bytecode offset.
+    int offsetCount; //< Length of offsets, the size of the function's bytecode.
+};
+
+bool jitCompile(VM* vm, ObjFunction* function);
+bool jitEnter(VM* vm, CallFrame* frame, uint8_t* ip);
+void jitFree(VM* vm, ObjFunction* function);
+
+// Runtime support for compiled code, defined in vm.c. Compiled code writes stackTop and the
+// frame's ip back to the VM before calling these, and passes the VM it's running in first.
+// The ones returning bool return false after reporting a runtime error.
+bool jitCall(VM* vm, int argCount);
+bool jitInvoke(VM* vm, CallFrame* frame, int nameConstant, int argCount, int cacheIndex);
+bool jitSuperInvoke(VM* vm, CallFrame* frame, int nameConstant, int argCount);
+bool jitGetProperty(VM* vm, CallFrame* frame, int nameConstant, int cacheIndex);
+bool jitSetProperty(VM* vm, CallFrame* frame, int nameConstant, int cacheIndex);
+bool jitGetSuper(VM* vm, CallFrame* frame, int nameConstant);
+bool jitAdd(VM* vm);
+void jitFlattenOperands(VM* vm);
+bool jitInherit(VM* vm);
+void jitError(VM* vm, const char* message);
+void jitUndefinedVariable(VM* vm, int slot);
+void jitMaterializeTop(VM* vm);
+void jitPrint(VM* vm);
+void jitClosure(VM* vm, CallFrame* frame, int offset);
+void jitCloseUpvalues(VM* vm, Value* last);
+void jitClass(VM* vm, CallFrame* frame, int nameConstant);
+void jitMethod(VM* vm, CallFrame* frame, int nameConstant);
+void jitSafepoint(VM* vm);
+void jitWriteBarrier(VM* vm, Obj* owner, Value value);
+
+#endif
@@ -10,7 +10,7 @@
 /**
  * @brief Run a REPL environment of lox, interpreting one line at a time.
  */
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -20,7 +20,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -62,11 +62,12 @@ static char* readFile(const char* path) {
  *
  * Exits with error 65 on compile error.
  * Exits with error 70 on runtime error.
+ * @param vm VM to run it in
  * @param path path of filename to open
  */
-static void runFile(const char* path) {
+static void runFile(VM* vm, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(vm, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
@@ -74,17 +75,26 @@ static void runFile(const char* path) {
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    VM vm;
+    initVM(&vm);
+
+    // Opt in to parallel marking on big heaps, e.g. CLOX_GC_THREADS=4.
+    const char* gcThreads = getenv("CLOX_GC_THREADS");
+    if (gcThreads != NULL && atoi(gcThreads) > 0) vm.gcThreads = atoi(gcThreads);
+
+    // Allow deeper recursion than FRAMES_MAX, e.g. CLOX_MAX_FRAMES=100000.
+    const char* maxFrames = getenv("CLOX_MAX_FRAMES");
+    if (maxFrames != NULL && atoi(maxFrames) > 0) vm.maxFrames = atoi(maxFrames);
 
     if (argc == 1) {
-        repl();
+        repl(&vm);
     } else if (argc == 2) {
-        runFile(argv[1]);
+        runFile(&vm, argv[1]);
     } else {
         fprintf(stderr, "Usage: clox [path]\n");
         exit(64);
     }
 
-    freeVM();
+    freeVM(&vm);
     return 0;
 }
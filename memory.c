@@ -1,6 +1,17 @@
+// For rand_r(), clock_gettime() and posix_memalign() in strict ISO modes.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -11,6 +22,65 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+/*
+ * Mark bits live in side bitmaps, one bit for every MARK_GRANULE bytes, rather than in the
+ * objects. Marking only writes to the bitmaps, so it leaves the heap's own memory (and any
+ * copy-on-write sharing with a forked parent) alone, and a cycle's marks get cleared with a memset.
+ * Nursery blocks and old generation pages are aligned to their size, so an object finds its
+ * bitmap by masking its address.
+ */
+
+#define MARK_GRANULE 8
+
+/**
+ * @brief Block of memory young objects are bump allocated from.
+ * The nursery is normally one block. If it fills up between safepoints more blocks get chained on,
+ * so allocation never has to move anything.
+ */
+struct NurseryBlock {
+    struct NurseryBlock* next; //< Next older block.
+    uint8_t* top; //< End of the objects in the block. Only kept for blocks older than the newest one.
+    uint64_t marks[NURSERY_SIZE / MARK_GRANULE / 64];
+    uint8_t data[];
+};
+
+#define BLOCK_OF(object) ((NurseryBlock*)((uintptr_t)(object) & ~(uintptr_t)(NURSERY_SIZE - 1)))
+
+// Young objects are laid out back to back, each rounded up to this.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+/**
+ * @brief What's left of a young object once it's been promoted.
+ */
+typedef struct {
+    Obj obj;
+    Obj* to; //< The old generation copy. Overwrites the object's first field.
+} Forwarded;
+
+/**
+ * @brief Size of an object's own allocation, not counting any arrays it points to.
+ */
+static size_t objectSize(Obj* object) {
+    // Forwarding overwrites the start of the fields, the copy is the same size.
+    if (object->isForwarded) object = ((Forwarded*)object)->to;
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS:        return sizeof(ObjClass);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+        case OBJ_FUNCTION:     return sizeof(ObjFunction);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+        case OBJ_NATIVE:       return sizeof(ObjNative);
+        case OBJ_SHAPE:        return sizeof(ObjShape);
+        case OBJ_STRING:
+            return ((ObjString*)object)->isRope ?
+                sizeof(ObjRope) : sizeof(ObjString) + ((ObjString*)object)->length + 1;
+        case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+    }
+    return 0; // Unreachable.
+}
+
 /**
  * @brief Resize or free pointers, based on newSize and oldSize
  *
@@ -23,14 +93,14 @@
  * @param newSize new capacity size of pointer
  * @return NULL if free, otherwise a resized value of pointer
  */
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        collectGarbage(vm);
 #endif
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        if (vm->bytesAllocated > vm->nextGC) {
+            gcStep(vm);
         }    
     }
 
@@ -46,47 +116,504 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 }
 
 /**
- * @brief Mark an object for GC. Won't get reaped if marked.
+ * @brief Allocate memory aligned to a power of two, for nursery blocks and pages.
+ * aligned_alloc() only came with C11, older modes get the POSIX equivalent.
+ * @return the memory, or NULL if there isn't enough
+ */
+static void* allocateAligned(size_t alignment, size_t size) {
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+    return aligned_alloc(alignment, size);
+#else
+    void* memory;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : NULL;
+#endif
+}
+
+static void addNurseryBlock(VM* vm) {
+    NurseryBlock* block = (NurseryBlock*)allocateAligned(NURSERY_SIZE, NURSERY_SIZE);
+    if (block == NULL) exit(1);
+    memset(block->marks, 0, sizeof(block->marks));
+
+    if (vm->nursery != NULL) vm->nursery->top = vm->nurseryTop;
+    block->next = vm->nursery;
+    vm->nursery = block;
+    vm->nurseryTop = block->data;
+    vm->nurseryEnd = (uint8_t*)block + NURSERY_SIZE;
+}
+
+void initNursery(VM* vm) {
+    vm->nursery = NULL;
+    vm->minorGCRequested = false;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+    addNurseryBlock(vm);
+}
+
+/**
+ * @brief Bump allocate the memory for a young object.
+ * Never collects the nursery itself - once the first block is full it asks run() for a minor GC
+ * at its next safepoint and carries on in a new block.
+ * @param size bytes needed
+ * @return the memory, uninitialized
+ */
+Obj* allocateYoung(VM* vm, size_t size) {
+    size = NURSERY_ALIGN(size);
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
+    vm->minorGCRequested = true;
+#endif
+
+    if (vm->nurseryTop + size > vm->nurseryEnd) {
+        addNurseryBlock(vm);
+        vm->minorGCRequested = true;
+    }
+
+    Obj* object = (Obj*)vm->nurseryTop;
+    vm->nurseryTop += size;
+    return object;
+}
+
+/*
+ * The old generation. Objects up to MAX_POOLED_SIZE live in pages split into equal slots, one
+ * pool of pages per size class. The classes are picked to fit closures, upvalues, bound methods
+ * and small instances exactly, so objects of one type sit together and the sweep can go a page at
+ * a time. The bigger classes are for strings, which keep their characters inline. Bigger objects
+ * get a page of their own, on the vm->largePages list.
+ */
+
+#define PAGE_SIZE (32 * 1024) //< Pages are aligned to their size, so an object's page is found by masking.
+#define PAGE_BITMAP_WORDS (PAGE_SIZE / MARK_GRANULE / 64)
+#define MAX_POOLED_SIZE 4096
+#define LARGE_OBJECT -1 //< Size class of a page holding one object bigger than MAX_POOLED_SIZE.
+
+static const uint16_t sizeClasses[SIZE_CLASS_COUNT] = {
+    16, 24, 32, 40, 48, 56, 64, 72, 80, 96, 112, 128, 160, 192, 256, 320, 384, 512, 640,
+    768, 1024, 1536, 2048, 3072, 4096
+};
+
+// Size class of every multiple of 8 bytes up to MAX_POOLED_SIZE, filled in once by the first initPools().
+static uint8_t sizeClassOf[MAX_POOLED_SIZE / 8 + 1];
+static pthread_once_t sizeClassOfOnce = PTHREAD_ONCE_INIT;
+
+typedef struct FreeSlot {
+    struct FreeSlot* next;
+} FreeSlot;
+
+struct Page {
+    struct Page* next; //< Next page of the same size class.
+    int sizeClass;
+    int liveCount; //< How many slots hold an object.
+    FreeSlot* freeList; //< Slots freed by the sweep.
+    uint8_t* top; //< Slots from here to end have never been used.
+    uint8_t* end;
+    uint64_t* marks; //< Mark bits, allocated on their own so marking never writes to the page.
+    uint64_t allocated[PAGE_BITMAP_WORDS]; //< Set at the first granule of every slot holding an object.
+};
+
+#define PAGE_OF(object) ((Page*)((uintptr_t)(object) & ~(uintptr_t)(PAGE_SIZE - 1)))
+#define PAGE_HEADER_SIZE ((sizeof(Page) + 15) & ~(size_t)15)
+
+static void initSizeClassOf() {
+    int sizeClass = 0;
+    for (int i = 0; i <= MAX_POOLED_SIZE / 8; i++) {
+        if (i * 8 > sizeClasses[sizeClass]) sizeClass++;
+        sizeClassOf[i] = (uint8_t)sizeClass;
+    }
+}
+
+void initPools(VM* vm) {
+    pthread_once(&sizeClassOfOnce, initSizeClassOf);
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        vm->pools[i].pages = NULL;
+        vm->pools[i].current = NULL;
+        vm->pools[i].unswept = NULL;
+    }
+    vm->largePages = NULL;
+    vm->largeUnswept = NULL;
+}
+
+/**
+ * @brief Map a new page.
+ * @param size bytes, a multiple of PAGE_SIZE
+ * @param sizeClass size class of the objects it will hold
+ */
+static Page* newPage(size_t size, int sizeClass) {
+    Page* page = (Page*)allocateAligned(PAGE_SIZE, size);
+    uint64_t* marks = (uint64_t*)calloc(PAGE_BITMAP_WORDS, sizeof(uint64_t));
+    if (page == NULL || marks == NULL) exit(1);
+
+    page->sizeClass = sizeClass;
+    page->liveCount = 0;
+    page->freeList = NULL;
+    page->top = (uint8_t*)page + PAGE_HEADER_SIZE;
+    page->end = (uint8_t*)page + size;
+    page->marks = marks;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    return page;
+}
+
+static void freePage(Page* page) {
+    free(page->marks);
+    free(page);
+}
+
+static inline size_t granuleOf(Page* page, void* slot) {
+    return (size_t)((uint8_t*)slot - (uint8_t*)page) / MARK_GRANULE;
+}
+
+static void sweepPage(VM* vm, Page* page);
+
+static inline bool pageFull(Page* page, size_t slotSize) {
+    return page->freeList == NULL && page->top + slotSize > page->end;
+}
+
+/**
+ * @brief Allocate memory for an old object. Doesn't start a GC, so it's safe to call while collecting.
+ * @param size bytes needed
+ * @return the memory, uninitialized
+ */
+static Obj* allocateOld(VM* vm, size_t size) {
+    Page* page;
+    uint8_t* slot;
+
+    if (size > MAX_POOLED_SIZE) {
+        size_t pageSize = (PAGE_HEADER_SIZE + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+        page = newPage(pageSize, LARGE_OBJECT);
+        page->next = vm->largePages;
+        vm->largePages = page;
+        slot = page->top;
+        page->top = page->end;
+        vm->bytesAllocated += size;
+    } else {
+        int sizeClass = sizeClassOf[(size + 7) / 8];
+        size_t slotSize = sizeClasses[sizeClass];
+        Pool* pool = &vm->pools[sizeClass];
+
+        // Carry on from the last page that had room, and only add a page once they're all full.
+        // New pages go on the end, so nothing gets walked past twice between sweeps.
+        Page** link = pool->current != NULL ? &pool->current : &pool->pages;
+        while (*link != NULL && pageFull(*link, slotSize)) {
+            link = &(*link)->next;
+        }
+        // Pages still waiting on the lazy sweep hold dead objects, sweep one before using it.
+        while (*link == NULL && pool->unswept != NULL) {
+            Page* swept = pool->unswept;
+            pool->unswept = swept->next;
+            swept->next = NULL;
+            // Move the next sweep step down by whatever gets freed, or it waits for the heap to grow back.
+            size_t before = vm->bytesAllocated;
+            sweepPage(vm, swept);
+            vm->nextGC -= before - vm->bytesAllocated;
+            *link = swept;
+            if (pageFull(swept, slotSize)) link = &swept->next;
+        }
+        if (*link == NULL) {
+            *link = newPage(PAGE_SIZE, sizeClass);
+            (*link)->next = NULL;
+        }
+        page = *link;
+        pool->current = page;
+
+        if (page->freeList != NULL) {
+            slot = (uint8_t*)page->freeList;
+            page->freeList = page->freeList->next;
+        } else {
+            slot = page->top;
+            page->top += slotSize;
+        }
+        vm->bytesAllocated += slotSize;
+    }
+
+    size_t granule = granuleOf(page, slot);
+    page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCount++;
+    return (Obj*)slot;
+}
+
+/**
+ * @brief Find an object's mark bit.
  * @param object 
+ * @param bit set to the mask for the object's bit
+ * @return the bitmap word holding it
  */
-void markObject(Obj* object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
+static inline uint64_t* markWord(Obj* object, uint64_t* bit) {
+    uint64_t* marks;
+    size_t granule;
+    if (object->isYoung) {
+        NurseryBlock* block = BLOCK_OF(object);
+        marks = block->marks;
+        granule = (size_t)((uint8_t*)object - (uint8_t*)block) / MARK_GRANULE;
+    } else {
+        Page* page = PAGE_OF(object);
+        marks = page->marks;
+        granule = granuleOf(page, object);
+    }
+    *bit = (uint64_t)1 << (granule % 64);
+    return &marks[granule / 64];
+}
+
+bool isMarked(Obj* object) {
+    uint64_t bit;
+    return (*markWord(object, &bit) & bit) != 0;
+}
+
+static inline void setMarked(Obj* object) {
+    uint64_t bit;
+    *markWord(object, &bit) |= bit;
+}
+
+/**
+ * @brief Allocate the memory for a new object too big for the nursery in the old generation.
+ * Only flat strings get that big, and they don't point at anything, so the object never needs
+ * scanning or remembering.
+ * @param size bytes needed, more than MAX_YOUNG_SIZE
+ * @return the memory, uninitialized apart from isYoung
+ */
+Obj* allocateTenured(VM* vm, size_t size) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
 #endif
+    if (vm->bytesAllocated + size > vm->nextGC) {
+        gcStep(vm);
+    }
+
+    Obj* object = allocateOld(vm, size);
+    object->isYoung = false;
+    // Marking might not look at the stack again, so born marked.
+    if (vm->gcState == GC_MARKING) setMarked(object);
+    return object;
+}
+
+/**
+ * @brief Set an object's mark bit when other threads might be marking too.
+ * @param object 
+ * @return true if this call marked it, false if it already was
+ */
+static inline bool tryMark(Obj* object) {
+    uint64_t bit;
+    _Atomic uint64_t* word = (_Atomic uint64_t*)markWord(object, &bit);
+    if (atomic_load_explicit(word, memory_order_relaxed) & bit) return false;
+    return !(atomic_fetch_or_explicit(word, bit, memory_order_relaxed) & bit);
+}
+
+/**
+ * @brief Call a function on every object in the nursery, dead or alive.
+ */
+static void walkNursery(VM* vm, void (*visit)(VM* vm, Obj* object)) {
+    for (NurseryBlock* block = vm->nursery; block != NULL; block = block->next) {
+        uint8_t* end = block == vm->nursery ? vm->nurseryTop : block->top;
+        for (uint8_t* p = block->data; p < end;) {
+            Obj* object = (Obj*)p;
+            p += NURSERY_ALIGN(objectSize(object));
+            visit(vm, object);
+        }
+    }
+}
+
+/**
+ * @brief Add an old object to the remembered set.
+ * @param object 
+ */
+void rememberObject(VM* vm, Obj* object) {
+    // Plain realloc, allocating here mustn't kick off a GC.
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+        if (vm->remembered == NULL) exit(1);
+    }
 
-    object->isMarked = true;
+    object->isRemembered = true;
+    vm->remembered[vm->rememberedCount++] = object;
+}
 
+/**
+ * @brief Push an object on the gray stack, the work list for both collectors.
+ * @param object 
+ */
+static void pushGray(VM* vm, Obj* object) {
     // We use C realloc so not to call GC when we're GC'ing. yo dawg.
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
 
         // If we can't allocate more memory for GC, we fail.
-        if (vm.grayStack == NULL) exit(1);
+        if (vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+/*
+ * Work lists for the parallel marker. Every marking thread has a deque of gray objects (Chase
+ * and Lev's). The owner pushes and pops at the bottom without locking, threads that run out of
+ * work steal from the top of someone else's.
+ */
+
+typedef struct GrayBuffer {
+    int64_t capacity; //< Always a power of 2.
+    struct GrayBuffer* older; //< Buffer this one replaced, a thief might still be reading it.
+    _Atomic(Obj*) items[];
+} GrayBuffer;
+
+typedef struct {
+    _Atomic int64_t top; //< Next item to steal.
+    _Atomic int64_t bottom; //< Next free item, only the owner moves it.
+    _Atomic(GrayBuffer*) buffer;
+} GrayDeque;
+
+static GrayBuffer* newGrayBuffer(int64_t capacity) {
+    GrayBuffer* buffer = (GrayBuffer*)malloc(sizeof(GrayBuffer) + sizeof(Obj*) * capacity);
+    if (buffer == NULL) exit(1);
+    buffer->capacity = capacity;
+    buffer->older = NULL;
+    return buffer;
+}
+
+static void initGrayDeque(GrayDeque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->buffer, newGrayBuffer(1024));
+}
+
+/**
+ * @brief Free the buffers a deque has outgrown. Only call this while nothing can be stealing.
+ * @param deque 
+ */
+static void trimGrayDeque(GrayDeque* deque) {
+    GrayBuffer* buffer = atomic_load(&deque->buffer);
+    GrayBuffer* older = buffer->older;
+    while (older != NULL) {
+        GrayBuffer* next = older->older;
+        free(older);
+        older = next;
+    }
+    buffer->older = NULL;
+}
+
+static void pushWork(GrayDeque* deque, Obj* object) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top >= buffer->capacity) {
+        // Copy into a buffer twice the size. Thieves might still be reading the old one, so it lives until trimGrayDeque().
+        GrayBuffer* bigger = newGrayBuffer(buffer->capacity * 2);
+        for (int64_t i = top; i < bottom; i++) {
+            atomic_store_explicit(&bigger->items[i & (bigger->capacity - 1)],
+                atomic_load_explicit(&buffer->items[i & (buffer->capacity - 1)], memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        bigger->older = buffer;
+        atomic_store_explicit(&deque->buffer, bigger, memory_order_release);
+        buffer = bigger;
+    }
+
+    atomic_store_explicit(&buffer->items[bottom & (buffer->capacity - 1)], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Obj* popWork(GrayDeque* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // Empty.
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj* object = atomic_load_explicit(&buffer->items[bottom & (buffer->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // Last item, race any thief for it.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            object = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static Obj* stealWork(GrayDeque* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    Obj* object = atomic_load_explicit(&buffer->items[top & (buffer->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL; // Lost to the owner or another thief.
+    }
+    return object;
+}
+
+static bool hasWork(GrayDeque* deque) {
+    return atomic_load_explicit(&deque->top, memory_order_acquire) <
+           atomic_load_explicit(&deque->bottom, memory_order_acquire);
+}
+
+// Deque of the marking thread this is, NULL outside the parallel marker.
+static _Thread_local GrayDeque* markDeque = NULL;
+
+/**
+ * @brief Mark an object for GC. Won't get reaped if marked.
+ * @param object 
+ */
+void markObject(VM* vm, Obj* object) {
+    if (object == NULL) return;
+    if (markDeque != NULL) {
+        if (tryMark(object)) pushWork(markDeque, object);
+        return;
     }
+    if (isMarked(object)) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
 
-    vm.grayStack[vm.grayCount++] = object;
+    setMarked(object);
+    pushGray(vm, object);
 }
 
 /**
  * @brief Make sure the value is an object (not a number, boolean, or nil)
  * @param value Value to check, and if an object, mark it
  */
-void markValue(Value value) {
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+void markValue(VM* vm, Value value) {
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
 /**
  * @brief Iterate over array, marking every value in it.
  * @param array Array to iterate over.
  */
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
+    }
+}
+
+/**
+ * @brief Mark the shapes and methods a chunk's inline caches have remembered, so they stay valid.
+ * @param chunk Chunk whose caches to mark.
+ */
+static void markInlineCaches(VM* vm, Chunk* chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            markObject(vm, (Obj*)cache->entries[j].shape);
+            markObject(vm, (Obj*)cache->entries[j].transition);
+            markValue(vm, cache->entries[j].method);
+        }
     }
 }
 
@@ -94,7 +621,7 @@ static void markArray(ValueArray* array) {
  * @brief Mark gray objects as black to tell the GC we've traversed it and don't need to look at it anymore
  * @param object object to mark as visited
  */
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -104,193 +631,1151 @@ static void blackenObject(Obj* object) {
     switch(object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj*)bound->method);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject(vm, (Obj*)klass->name);
+            markTable(vm, &klass->methods);
+            markObject(vm, (Obj*)klass->initializer);
+            markObject(vm, (Obj*)klass->rootShape);
             break;
         }
         // Mark any upvalues and any functions in closures.
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            markObject(vm, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject(vm, (Obj*)closure->upvalues[i]);
             }
             break;
         }
         // Mark the function name and any constants in its table.
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj*)function->name);
+            markArray(vm, &function->chunk.constants);
+            markInlineCaches(vm, &function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject(vm, (Obj*)instance->klass);
+            markObject(vm, (Obj*)instance->shape);
+            for (int i = 0; i < instance->fieldCount; i++) {
+                markValue(vm, instance->fields[i]);
+            }
+            if (instance->slotTable != NULL) markTable(vm, instance->slotTable);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject(vm, (Obj*)shape->klass);
+            markObject(vm, (Obj*)shape->parent);
+            markObject(vm, (Obj*)shape->name);
+            markTable(vm, &shape->transitions);
             break;
         }
         // Mark closed values in upvalues.
         case OBJ_UPVALUE:
-            markValue(((ObjUpvalue*)object)->closed);
+            markValue(vm, ((ObjUpvalue*)object)->closed);
             break;
+        // A rope's halves, or the flat string it was flattened to.
+        case OBJ_STRING: {
+            if (!((ObjString*)object)->isRope) break;
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, (Obj*)rope->left);
+            markObject(vm, (Obj*)rope->right);
+            break;
+        }
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif
-
+/**
+ * @brief Free everything an object owns, but not the object itself.
+ * Dead young objects only need this, the nursery memory gets reused wholesale.
+ * @param object 
+ */
+static void freeObjectContents(VM* vm, Obj* object) {
     switch (object->type) {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
-            break;
-        case OBJ_CLASS: {
-            ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
-            break;
-        }
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(OBJ_CLOSURE, object);
+        case OBJ_CLASS:
+            freeTable(vm, &((ObjClass*)object)->methods);
             break;
-        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+#ifdef BASELINE_JIT
+            jitFree(vm, function);
+#endif
+            freeChunk(vm, &function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
-            break;
-        }
-        case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+            }
+            if (instance->slotTable != NULL) {
+                freeTable(vm, instance->slotTable);
+                FREE(vm, Table, instance->slotTable);
+            }
             break;
         }
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_SHAPE:
+            freeTable(vm, &((ObjShape*)object)->transitions);
             break;
-        }
-        case OBJ_UPVALUE: {
-            FREE(OBJ_UPVALUE, object);
+        case OBJ_BOUND_METHOD:
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_UPVALUE:
             break;
-        }
     }
 }
 
 /**
- * @brief Mark local variables or temporaries on the vm stack
+ * @brief Mark the roots that change all the time without a write barrier.
+ * Local variables or temporaries on the vm stack
  * Then the closures
  * Then the upvalues
- * Then the global variables
  * Then anything the compiler is using
  */
-static void markRoots() {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+static void markStackRoots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    // Only the lazily bound methods still on the stack are live, drop the rest first.
+    reclaimLazyBounds(vm);
+    for (int i = 0; i < vm->lazyBoundCapacity; i++) {
+        LazyBound* bound = &vm->lazyBounds[i];
+        if (bound->method == NULL) continue;
+        markValue(vm, bound->receiver);
+        markObject(vm, (Obj*)bound->method);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*)frameAt(vm, i)->function);
+        markObject(vm, (Obj*)frameAt(vm, i)->closure);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
+    }
+
+    markCompilerRoots(vm);
+    markObject(vm, (Obj*)vm->initString);
 }
 
 /**
- * @brief Walk through gray objects and mark them black once traversed.
+ * @brief Mark every root - the stack roots, then the global variables.
  */
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
-    }
-}
-
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    // Walk the linked list of every object in the heap
-    while (object != NULL) {
-        // If object is black (marked), leave it alone
-        if (object->isMarked) {
-            // Reset black (marked) objects to white (unmarked) for next GC run.
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        // Else unlink the object
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            // If we're freeing the first node.
-            } else {
-                vm.objects = object;
+static void markRoots(VM* vm) {
+    markStackRoots(vm);
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
+}
+
+/*
+ * Parallel marking. Once the heap is big enough and vm->gcThreads asks for it, marking steps
+ * deal the gray stack out to the deques of vm->gcThreads threads, the VM's own thread and helpers
+ * that sleep between steps. Everything else is stopped while they run, so the only thing they
+ * race on is the mark bits, which tryMark() sets atomically. Every VM has helpers of its own,
+ * started the first time it marks in parallel, so VMs on different threads never wait on each other.
+ */
+
+static uint64_t nowMicros();
+
+typedef struct {
+    GrayDeque deque;
+    pthread_t thread;
+    Marker* marker; //< Marker the thread belongs to.
+    unsigned int seed; //< For picking who to steal from.
+    uint64_t round; //< Last step the thread worked on.
+} MarkWorker;
+
+/**
+ * @brief A VM's marking threads, and what they share during a step.
+ */
+struct Marker {
+    VM* vm;
+    MarkWorker workers[GC_THREADS_MAX]; //< The VM's own thread is workers[0].
+    int threadCount; //< Threads started so far, counting the VM's.
+    int active; //< Threads taking part in this step.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    uint64_t round; //< Bumped to start a step.
+    int running; //< Helpers still working on this step.
+    bool shutdown;
+    uint64_t deadline;
+    atomic_int idle; //< Threads out of work. Marking is done when every thread is.
+    atomic_bool timeUp;
+};
+
+static Marker* newMarker(VM* vm) {
+    // Plain malloc, like the gray stack it isn't part of the heap.
+    Marker* marker = (Marker*)malloc(sizeof(Marker));
+    if (marker == NULL) exit(1);
+    marker->vm = vm;
+    marker->threadCount = 1;
+    marker->active = 1;
+    pthread_mutex_init(&marker->lock, NULL);
+    pthread_cond_init(&marker->wake, NULL);
+    pthread_cond_init(&marker->finished, NULL);
+    marker->round = 0;
+    marker->running = 0;
+    marker->shutdown = false;
+
+    MarkWorker* self = &marker->workers[0];
+    initGrayDeque(&self->deque);
+    self->marker = marker;
+    self->seed = 0;
+    self->round = 0;
+    return marker;
+}
+
+/**
+ * @brief Steal a gray object from another thread.
+ * @param self the thief
+ * @return the object, or NULL if nobody had any to spare
+ */
+static Obj* stealFromOthers(MarkWorker* self) {
+    Marker* marker = self->marker;
+    int start = rand_r(&self->seed) % marker->active;
+    for (int i = 0; i < marker->active; i++) {
+        MarkWorker* victim = &marker->workers[(start + i) % marker->active];
+        if (victim == self) continue;
+        Obj* object = stealWork(&victim->deque);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool othersHaveWork(MarkWorker* self) {
+    Marker* marker = self->marker;
+    for (int i = 0; i < marker->active; i++) {
+        if (&marker->workers[i] != self && hasWork(&marker->workers[i].deque)) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Blacken objects from a thread's own deque, then other threads', until marking is done or out of time.
+ * @param self 
+ */
+static void drainGray(MarkWorker* self) {
+    Marker* marker = self->marker;
+    markDeque = &self->deque;
+    int untilCheck = 64;
+
+    for (;;) {
+        Obj* object;
+        while ((object = popWork(&self->deque)) != NULL || (object = stealFromOthers(self)) != NULL) {
+            blackenObject(marker->vm, object);
+            if (--untilCheck == 0) {
+                untilCheck = 64;
+                if (atomic_load_explicit(&marker->timeUp, memory_order_relaxed)) goto done;
+                if (marker->deadline != UINT64_MAX && nowMicros() >= marker->deadline) {
+                    atomic_store(&marker->timeUp, true);
+                    goto done;
+                }
             }
+        }
 
-            freeObject(unreached);
+        // An idle thread's deque stays empty, so once all of them are idle there's nothing left.
+        // Stop counting as idle before going after more work, or someone might finish early.
+        atomic_fetch_add(&marker->idle, 1);
+        for (;;) {
+            if (atomic_load(&marker->idle) == marker->active || atomic_load(&marker->timeUp)) goto done;
+            if (othersHaveWork(self)) {
+                atomic_fetch_sub(&marker->idle, 1);
+                break;
+            }
+            sched_yield();
         }
     }
+
+done:
+    markDeque = NULL;
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
-#endif
+static void* markThread(void* arg) {
+    MarkWorker* self = (MarkWorker*)arg;
+    Marker* marker = self->marker;
+    int index = (int)(self - marker->workers);
 
-    // Mark items for GC
-    markRoots();
-    // Trace all items, turning gray to black.
-    traceReferences();
-    // Get rid of string table items if needed.
-    tableRemoveWhite(&vm.strings);
-    // Get rid of all white (unmarked items) objects.
-    sweep();
+    pthread_mutex_lock(&marker->lock);
+    for (;;) {
+        while (marker->round == self->round && !marker->shutdown) pthread_cond_wait(&marker->wake, &marker->lock);
+        if (marker->shutdown) break;
+        self->round = marker->round;
+        pthread_mutex_unlock(&marker->lock);
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        if (index < marker->active) drainGray(self);
 
-#ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated,
-                                                                     before, 
-                                                                     vm.bytesAllocated,
-                                                                     vm.nextGC);
-#endif
+        pthread_mutex_lock(&marker->lock);
+        if (--marker->running == 0) pthread_cond_signal(&marker->finished);
+    }
+    pthread_mutex_unlock(&marker->lock);
+    return NULL;
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+/**
+ * @brief Blacken gray objects on vm->gcThreads threads, until there aren't any or the step is out of time.
+ * @param deadline time to stop, from nowMicros(), or UINT64_MAX to finish marking
+ * @return true if the gray stack is empty
+ */
+static bool markParallel(VM* vm, uint64_t deadline) {
+    if (vm->marker == NULL) vm->marker = newMarker(vm);
+    Marker* marker = vm->marker;
+
+    int threads = vm->gcThreads > GC_THREADS_MAX ? GC_THREADS_MAX : vm->gcThreads;
+    while (marker->threadCount < threads) {
+        MarkWorker* worker = &marker->workers[marker->threadCount];
+        initGrayDeque(&worker->deque);
+        worker->marker = marker;
+        worker->seed = (unsigned int)marker->threadCount;
+        worker->round = marker->round;
+        if (pthread_create(&worker->thread, NULL, markThread, worker) != 0) {
+            free(atomic_load(&worker->deque.buffer));
+            break;
+        }
+        marker->threadCount++;
+    }
+    marker->active = threads < marker->threadCount ? threads : marker->threadCount;
+
+    // Split what's gray (the roots, at the start of a cycle) between the threads.
+    for (int i = 0; i < vm->grayCount; i++) {
+        pushWork(&marker->workers[i % marker->active].deque, vm->grayStack[i]);
+    }
+    vm->grayCount = 0;
+
+    marker->deadline = deadline;
+    atomic_store(&marker->idle, 0);
+    atomic_store(&marker->timeUp, false);
+
+    pthread_mutex_lock(&marker->lock);
+    marker->running = marker->threadCount - 1;
+    marker->round++;
+    pthread_cond_broadcast(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+
+    drainGray(&marker->workers[0]);
+
+    pthread_mutex_lock(&marker->lock);
+    while (marker->running > 0) pthread_cond_wait(&marker->finished, &marker->lock);
+    pthread_mutex_unlock(&marker->lock);
+
+    // Out of time - put whatever is still gray back for the next step.
+    for (int i = 0; i < marker->active; i++) {
+        GrayDeque* deque = &marker->workers[i].deque;
+        Obj* object;
+        while ((object = popWork(deque)) != NULL) pushGray(vm, object);
+        trimGrayDeque(deque);
+    }
+    return vm->grayCount == 0;
+}
+
+static bool useParallelMark(VM* vm) {
+    return vm->gcThreads > 1 && vm->bytesAllocated >= PARALLEL_MARK_MIN_HEAP;
+}
+
+/**
+ * @brief Stop the VM's helper marking threads and free their deques.
+ */
+static void stopMarkThreads(VM* vm) {
+    Marker* marker = vm->marker;
+    if (marker == NULL) return;
+
+    pthread_mutex_lock(&marker->lock);
+    marker->shutdown = true;
+    pthread_cond_broadcast(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+
+    for (int i = 0; i < marker->threadCount; i++) {
+        if (i > 0) pthread_join(marker->workers[i].thread, NULL);
+        trimGrayDeque(&marker->workers[i].deque);
+        free(atomic_load(&marker->workers[i].deque.buffer));
+    }
+    pthread_mutex_destroy(&marker->lock);
+    pthread_cond_destroy(&marker->wake);
+    pthread_cond_destroy(&marker->finished);
+    free(marker);
+    vm->marker = NULL;
+}
+
+/**
+ * @brief Walk through gray objects and mark them black once traversed.
+ */
+static void traceReferences(VM* vm) {
+    if (useParallelMark(vm)) {
+        markParallel(vm, UINT64_MAX);
+        return;
+    }
+
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+    }
+}
+
+/**
+ * @brief Free the unmarked objects in a page and clear its marks for the next GC run.
+ * Pages where everything survived only need their marks cleared.
+ * @param page 
+ */
+static void sweepPage(VM* vm, Page* page) {
+    if (memcmp(page->allocated, page->marks, sizeof(page->allocated)) != 0) {
+        for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+            uint64_t dead = page->allocated[word] & ~page->marks[word];
+            for (int bit = 0; dead != 0; bit++, dead >>= 1) {
+                if (!(dead & 1)) continue;
+
+                uint8_t* slot = (uint8_t*)page + (word * 64 + bit) * MARK_GRANULE;
+                Obj* object = (Obj*)slot;
+#ifdef DEBUG_LOG_GC
+                printf("%p free type %d\n", (void*)object, object->type);
+#endif
+                vm->bytesAllocated -= page->sizeClass == LARGE_OBJECT ?
+                    objectSize(object) : sizeClasses[page->sizeClass];
+                freeObjectContents(vm, object);
+                page->liveCount--;
+
+                FreeSlot* freeSlot = (FreeSlot*)slot;
+                freeSlot->next = page->freeList;
+                page->freeList = freeSlot;
+            }
+            page->allocated[word] &= page->marks[word];
+        }
+    }
+    memset(page->marks, 0, PAGE_BITMAP_WORDS * sizeof(uint64_t));
+}
+
+/**
+ * @brief Hand every old page to the lazy sweep. Their marks stay set until each one gets swept.
+ */
+static void startSweep(VM* vm) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        Pool* pool = &vm->pools[i];
+        pool->unswept = pool->pages;
+        pool->pages = NULL;
+        pool->current = NULL;
+    }
+    vm->largeUnswept = vm->largePages;
+    vm->largePages = NULL;
+}
+
+/**
+ * @brief Put a swept page where allocation will get to it next.
+ * @param pool 
+ * @param page 
+ */
+static void addSweptPage(Pool* pool, Page* page) {
+    if (pool->current != NULL) {
+        page->next = pool->current->next;
+        pool->current->next = page;
+    } else {
+        page->next = pool->pages;
+        pool->pages = page;
+    }
+}
+
+/**
+ * @brief Drop old objects that are about to be freed from the remembered set.
+ */
+static void removeWhiteRemembered(VM* vm) {
+    int count = 0;
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj* object = vm->remembered[i];
+        if (isMarked(object)) {
+            vm->remembered[count++] = object;
+        }
+    }
+    vm->rememberedCount = count;
+}
+
+static void unmarkNursery(VM* vm) {
+    for (NurseryBlock* block = vm->nursery; block != NULL; block = block->next) {
+        memset(block->marks, 0, sizeof(block->marks));
+    }
+}
+
+/*
+ * Minor GC. Young objects reachable from the roots or from the remembered set get copied into
+ * the old generation, then the whole nursery is reused. Promoted objects are scanned Cheney style
+ * off the gray stack, so each one's young references get promoted and updated in turn.
+ *
+ * Copying moves objects, so it only happens at safepoints in run() and in compiled code, where
+ * everything that points at an object is somewhere the GC can see and update.
+ */
+
+static Obj* promote(VM* vm, Obj* object);
+
+static inline Obj* forwardObject(VM* vm, Obj* object) {
+    if (object == NULL) return object;
+    if (object->isForwarded) return ((Forwarded*)object)->to; // Promoted, or moved by compactOld().
+    if (!object->isYoung) return object;
+    return promote(vm, object);
+}
+
+static inline Value forwardValue(VM* vm, Value value) {
+    if (IS_OBJ(value)) return OBJ_VAL(forwardObject(vm, AS_OBJ(value)));
+    return value;
+}
+
+static void forwardArray(VM* vm, ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        array->values[i] = forwardValue(vm, array->values[i]);
+    }
+}
+
+static void forwardTable(VM* vm, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        entry->key = (ObjString*)forwardObject(vm, (Obj*)entry->key);
+        entry->value = forwardValue(vm, entry->value);
+    }
+}
+
+/**
+ * @brief Copy an object into an old generation slot, leaving the new address behind in the original.
+ * @param object young object, or old object being compacted
+ * @return the copy
+ */
+static Obj* moveObject(VM* vm, Obj* object) {
+    // Not reallocate(), a full GC can't start part way through a minor one.
+    size_t size = objectSize(object);
+    Obj* copy = allocateOld(vm, size);
+    memcpy(copy, object, size);
+    object->isForwarded = true;
+    ((Forwarded*)object)->to = copy;
+
+    // Fix up anything pointing into the object itself.
+    switch (copy->type) {
+        case OBJ_CLASS:
+            ((ObjClass*)copy)->methods.owner = copy;
+            break;
+        case OBJ_FUNCTION:
+            ((ObjFunction*)copy)->chunk.constants.owner = copy;
+            break;
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)copy;
+            if (instance->fields == ((ObjInstance*)object)->inlineFields) {
+                instance->fields = instance->inlineFields;
+            }
+            if (instance->slotTable != NULL) instance->slotTable->owner = copy;
+            break;
+        }
+        case OBJ_SHAPE:
+            ((ObjShape*)copy)->transitions.owner = copy;
+            break;
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+            if (upvalue->location == &((ObjUpvalue*)object)->closed) {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+/**
+ * @brief Copy a young object into the old generation, leaving the new address behind in the young copy.
+ * @param object young object
+ * @return the object's old generation copy
+ */
+static Obj* promote(VM* vm, Obj* object) {
+    if (object->isForwarded) return ((Forwarded*)object)->to; // Already promoted.
+
+    Obj* copy = moveObject(vm, object);
+    // Keep the mark, an incremental mark might be part way through.
+    copy->isYoung = false;
+    copy->isRemembered = false;
+    if (isMarked(object)) setMarked(copy);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif
+
+    pushGray(vm, copy);
+    return copy;
+}
+
+/**
+ * @brief Promote every young object an old object points at, and point it at the copies instead.
+ * Inline caches don't need it, they never hold young objects.
+ * @param object old object
+ */
+static void scanObject(VM* vm, Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            bound->receiver = forwardValue(vm, bound->receiver);
+            bound->method = (ObjClosure*)forwardObject(vm, (Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)forwardObject(vm, (Obj*)klass->name);
+            forwardTable(vm, &klass->methods);
+            klass->initializer = (ObjClosure*)forwardObject(vm, (Obj*)klass->initializer);
+            klass->rootShape = (ObjShape*)forwardObject(vm, (Obj*)klass->rootShape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            closure->function = (ObjFunction*)forwardObject(vm, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (ObjUpvalue*)forwardObject(vm, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)forwardObject(vm, (Obj*)function->name);
+            forwardArray(vm, &function->chunk.constants);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            instance->klass = (ObjClass*)forwardObject(vm, (Obj*)instance->klass);
+            instance->shape = (ObjShape*)forwardObject(vm, (Obj*)instance->shape);
+            for (int i = 0; i < instance->fieldCount; i++) {
+                instance->fields[i] = forwardValue(vm, instance->fields[i]);
+            }
+            if (instance->slotTable != NULL) forwardTable(vm, instance->slotTable);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            shape->klass = (ObjClass*)forwardObject(vm, (Obj*)shape->klass);
+            shape->parent = (ObjShape*)forwardObject(vm, (Obj*)shape->parent);
+            shape->name = (ObjString*)forwardObject(vm, (Obj*)shape->name);
+            forwardTable(vm, &shape->transitions);
+            break;
+        }
+        // Only the closed value - next is the VM's open upvalue list, which is a root.
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            upvalue->closed = forwardValue(vm, upvalue->closed);
+            break;
+        }
+        case OBJ_STRING: {
+            if (!((ObjString*)object)->isRope) break;
+            ObjRope* rope = (ObjRope*)object;
+            rope->left = (ObjString*)forwardObject(vm, (Obj*)rope->left);
+            rope->right = (ObjString*)forwardObject(vm, (Obj*)rope->right);
+            break;
+        }
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+static void forwardRoots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        *slot = forwardValue(vm, *slot);
+    }
+
+    for (int i = 0; i < vm->lazyBoundCapacity; i++) {
+        LazyBound* bound = &vm->lazyBounds[i];
+        if (bound->method == NULL) continue;
+        bound->receiver = forwardValue(vm, bound->receiver);
+        bound->method = (ObjClosure*)forwardObject(vm, (Obj*)bound->method);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = frameAt(vm, i);
+        frame->function = (ObjFunction*)forwardObject(vm, (Obj*)frame->function);
+        frame->closure = (ObjClosure*)forwardObject(vm, (Obj*)frame->closure);
+    }
+
+    for (ObjUpvalue** upvalue = &vm->openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->next) {
+        *upvalue = (ObjUpvalue*)forwardObject(vm, (Obj*)*upvalue);
+        vm->openUpvalueSlots[(*upvalue)->location - vm->stack] = *upvalue;
+    }
+
+    forwardTable(vm, &vm->globalSlots);
+    forwardArray(vm, &vm->globalNames);
+    forwardArray(vm, &vm->globalValues);
+    vm->initString = (ObjString*)forwardObject(vm, (Obj*)vm->initString);
+}
+
+/**
+ * @brief The string table doesn't keep strings alive - point it at promoted strings and drop the dead ones.
+ */
+static void forwardStrings(VM* vm) {
+    for (int i = 0; i < vm->strings.capacity; i++) {
+        Entry* entry = &vm->strings.entries[i];
+        if (entry->key == NULL || !entry->key->obj.isYoung) continue;
+
+        if (entry->key->obj.isForwarded) {
+            entry->key = (ObjString*)((Forwarded*)entry->key)->to;
+        } else {
+            tableDelete(&vm->strings, entry->key);
+        }
+    }
+}
+
+static void freeIfDead(VM* vm, Obj* object) {
+    if (!object->isForwarded) freeObjectContents(vm, object);
+}
+
+/**
+ * @brief Free what the dead young objects own, and start the nursery over with one empty block.
+ */
+static void resetNursery(VM* vm) {
+    walkNursery(vm, freeIfDead);
+
+    while (vm->nursery->next != NULL) {
+        NurseryBlock* block = vm->nursery;
+        vm->nursery = block->next;
+        free(block);
+    }
+    memset(vm->nursery->marks, 0, sizeof(vm->nursery->marks));
+    vm->nurseryTop = vm->nursery->data;
+    vm->nurseryEnd = (uint8_t*)vm->nursery + NURSERY_SIZE;
+}
+
+/*
+ * Compaction. Objects in the old generation normally stay put, so once a lot of them have died
+ * the pools are left with pages that are mostly holes. When the sweep finds more than
+ * vm->compactThreshold percent of the pool pages wasted, the next minor GC ends by evacuating the
+ * sparsest pages into the holes in the others, then giving the empty pages back.
+ *
+ * It reuses the minor GC's forwarding: a moved object is left flagged isForwarded with its new
+ * address, and forwardObject() follows that. Nothing tracks old to old pointers, so every root
+ * and every old object has to be gone over. It only runs when the nursery is empty and the full
+ * GC is idle, so every allocated slot holds a valid object and no marks need moving.
+ */
+
+/**
+ * @brief Call a function on every object in a list of pages.
+ * @param page the list's head
+ * @param visit 
+ */
+static void walkPages(VM* vm, Page* page, void (*visit)(VM* vm, Obj* object)) {
+    for (; page != NULL; page = page->next) {
+        for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+            uint64_t allocated = page->allocated[word];
+            for (int bit = 0; allocated != 0; bit++, allocated >>= 1) {
+                if (allocated & 1) visit(vm, (Obj*)((uint8_t*)page + (word * 64 + bit) * MARK_GRANULE));
+            }
+        }
+    }
+}
+
+static inline size_t pageCapacity(int sizeClass) {
+    return (PAGE_SIZE - PAGE_HEADER_SIZE) / sizeClasses[sizeClass];
+}
+
+/**
+ * @brief Check whether enough of the pools is holes to be worth compacting.
+ * @return true if more than vm->compactThreshold percent of the pool pages is free slots
+ */
+static bool isFragmented(VM* vm) {
+    if (vm->compactThreshold == 0) return false;
+
+    size_t pageBytes = 0;
+    size_t liveBytes = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        for (Page* page = vm->pools[i].pages; page != NULL; page = page->next) {
+            pageBytes += PAGE_SIZE;
+            liveBytes += (size_t)page->liveCount * sizeClasses[i];
+        }
+    }
+    return pageBytes >= COMPACT_MIN_HEAP && (pageBytes - liveBytes) * 100 > pageBytes * (size_t)vm->compactThreshold;
+}
+
+static int compareLiveCount(const void* a, const void* b) {
+    return (*(Page* const*)a)->liveCount - (*(Page* const*)b)->liveCount;
+}
+
+/**
+ * @brief Pick the pages of a pool to empty. Takes the sparsest half full pages while the rest
+ * have enough free slots for everything in them, so compacting never adds a page.
+ * @param pool 
+ * @param sizeClass 
+ * @return the pages to evacuate, already unlinked from the pool
+ */
+static Page* pickEvacuees(Pool* pool, int sizeClass) {
+    int count = 0;
+    for (Page* page = pool->pages; page != NULL; page = page->next) count++;
+    if (count < 2) return NULL;
+
+    Page** pages = (Page**)malloc(sizeof(Page*) * count);
+    if (pages == NULL) exit(1);
+    count = 0;
+    for (Page* page = pool->pages; page != NULL; page = page->next) pages[count++] = page;
+    qsort(pages, count, sizeof(Page*), compareLiveCount);
+
+    size_t capacity = pageCapacity(sizeClass);
+    size_t freeSlots = 0;
+    for (int i = 0; i < count; i++) freeSlots += capacity - pages[i]->liveCount;
+
+    int evacuees = 0;
+    size_t needed = 0;
+    while (evacuees < count - 1) {
+        Page* page = pages[evacuees];
+        size_t live = page->liveCount;
+        if (live * 2 > capacity) break;
+        // Its own free slots don't count once it's being emptied.
+        if (freeSlots - (capacity - live) < needed + live) break;
+        freeSlots -= capacity - live;
+        needed += live;
+        evacuees++;
+    }
+
+    Page* evacuated = NULL;
+    for (int i = 0; i < evacuees; i++) {
+        pages[i]->next = evacuated;
+        evacuated = pages[i];
+    }
+    // Keep the rest fullest first, so the moved objects fill the fewest pages.
+    pool->pages = NULL;
+    for (int i = evacuees; i < count; i++) {
+        pages[i]->next = pool->pages;
+        pool->pages = pages[i];
+    }
+    pool->current = pool->pages;
+
+    free(pages);
+    return evacuated;
+}
+
+static void evacuate(VM* vm, Obj* object) {
+    moveObject(vm, object);
+}
+
+/**
+ * @brief Point an old object's fields at where the objects they hold were moved to.
+ * Unlike a minor GC, inline caches need it too.
+ * @param object 
+ */
+static void fixReferences(VM* vm, Obj* object) {
+    scanObject(vm, object);
+    if (object->type != OBJ_FUNCTION) return;
+
+    Chunk* chunk = &((ObjFunction*)object)->chunk;
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry* entry = &cache->entries[j];
+            entry->shape = (ObjShape*)forwardObject(vm, (Obj*)entry->shape);
+            entry->transition = (ObjShape*)forwardObject(vm, (Obj*)entry->transition);
+            entry->method = forwardValue(vm, entry->method);
+        }
+    }
+}
+
+/**
+ * @brief Move the objects out of the sparsest pool pages and give the pages back.
+ * Only call this from a safepoint, right after collectNursery().
+ */
+static void compactOld(VM* vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+    int freedPages = 0;
+#endif
+
+    vm->compactRequested = false;
+    clearMegamorphicCache(vm);
+    clearMethodCache(vm);
+
+    Page* evacuated[SIZE_CLASS_COUNT];
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        evacuated[i] = pickEvacuees(&vm->pools[i], i);
+        walkPages(vm, evacuated[i], evacuate);
+    }
+
+    forwardRoots(vm);
+    forwardTable(vm, &vm->strings);
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        walkPages(vm, vm->pools[i].pages, fixReferences);
+    }
+    walkPages(vm, vm->largePages, fixReferences);
+
+    // What the moved objects own went with them, so only the pages need freeing.
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        Page* page = evacuated[i];
+        while (page != NULL) {
+            Page* next = page->next;
+            vm->bytesAllocated -= (size_t)page->liveCount * sizeClasses[i];
+            freePage(page);
+#ifdef DEBUG_LOG_GC
+            freedPages++;
+#endif
+            page = next;
+        }
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   freed %d pages\n", freedPages);
+#endif
+}
+
+/**
+ * @brief Minor GC - promote the live young objects to the old generation and empty the nursery.
+ * Only call this from a safepoint, see above.
+ */
+void collectNursery(VM* vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    vm->minorGCRequested = false;
+    clearMegamorphicCache(vm);
+    clearMethodCache(vm);
+
+    // The marker's gray objects sit below base. They're still to be blackened, so they're roots too.
+    int base = vm->grayCount;
+    for (int i = 0; i < base; i++) {
+        Obj* object = forwardObject(vm, vm->grayStack[i]); // Can grow the gray stack.
+        vm->grayStack[i] = object;
+    }
+
+    forwardRoots(vm);
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        vm->remembered[i]->isRemembered = false;
+        scanObject(vm, vm->remembered[i]);
+    }
+    vm->rememberedCount = 0;
+
+    while (vm->grayCount > base) {
+        scanObject(vm, vm->grayStack[--vm->grayCount]);
+    }
+
+    forwardStrings(vm);
+    resetNursery(vm);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm->bytesAllocated - before);
+#endif
+
+    if (vm->bytesAllocated > vm->nextGC) {
+        gcStep(vm);
+    }
+    if (vm->compactRequested && vm->gcState == GC_IDLE) {
+        compactOld(vm);
+    }
+}
+
+/*
+ * Full GC - incremental mark and sweep over both generations. Marking is spread over many short
+ * steps, each run from an allocation and stopped after vm->gcPauseBudget microseconds. Young
+ * objects get marked like the rest, and keep their mark if a minor GC promotes them part way.
+ *
+ * The write barrier keeps the tri-color invariant between steps: while marking, storing an
+ * object into a marked object or a global shades it gray, so a black object never points at a
+ * white one. The stack, frames and open upvalues change too often for a barrier, so they get
+ * marked again at the end, in one step that runs all at once.
+ *
+ * Sweeping is lazy. Once marking is done every old page goes on an unswept list, and gets swept
+ * either when allocation needs a page of its size class or by later steps, a pause budget at a
+ * time. A page is always swept before anything gets allocated in it, and the next cycle can't
+ * start marking until every page has been, so a stale mark never outlives its cycle.
+ */
+
+static uint64_t nowMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Sweep pages allocation hasn't got to yet, until there aren't any or the step is out of time.
+ * Pages that end up empty are given back.
+ * @param deadline time to stop, from nowMicros(), or UINT64_MAX to finish sweeping
+ * @return true if every page has been swept
+ */
+static bool sweepSome(VM* vm, uint64_t deadline) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        Pool* pool = &vm->pools[i];
+        while (pool->unswept != NULL) {
+            Page* page = pool->unswept;
+            pool->unswept = page->next;
+            sweepPage(vm, page);
+            if (page->liveCount == 0) {
+                freePage(page);
+            } else {
+                addSweptPage(pool, page);
+            }
+            if (deadline != UINT64_MAX && nowMicros() >= deadline) return false;
+        }
+    }
+
+    while (vm->largeUnswept != NULL) {
+        Page* page = vm->largeUnswept;
+        vm->largeUnswept = page->next;
+        sweepPage(vm, page);
+        if (page->liveCount == 0) {
+            freePage(page);
+        } else {
+            page->next = vm->largePages;
+            vm->largePages = page;
+        }
+        if (deadline != UINT64_MAX && nowMicros() >= deadline) return false;
+    }
+    return true;
+}
+
+static void finishSweep(VM* vm) {
+    vm->gcState = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+    // Compacting moves old objects, which can only happen at a safepoint.
+    if (isFragmented(vm)) {
+        vm->compactRequested = true;
+        vm->minorGCRequested = true;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes live, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+static void startCycle(VM* vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    vm->gcState = GC_MARKING;
+    markRoots(vm);
+}
+
+/**
+ * @brief Blacken gray objects until there aren't any, or the step is out of time.
+ * @param deadline time to stop, from nowMicros()
+ * @return true if the gray stack is empty
+ */
+static bool markSome(VM* vm, uint64_t deadline) {
+    if (useParallelMark(vm)) return markParallel(vm, deadline);
+
+    // Checking the clock costs more than blackening most objects, so only do it every so often.
+    int untilCheck = 64;
+    while (vm->grayCount > 0) {
+        blackenObject(vm, vm->grayStack[--vm->grayCount]);
+        if (--untilCheck == 0) {
+            if (nowMicros() >= deadline) break;
+            untilCheck = 64;
+        }
+    }
+    return vm->grayCount == 0;
+}
+
+/**
+ * @brief Finish marking and start sweeping. Runs all at once, nothing can change part way through.
+ */
+static void finishCycle(VM* vm) {
+    markStackRoots(vm);
+    traceReferences(vm);
+
+    // The megamorphic and method caches don't keep anything alive, so forget them before things get freed.
+    clearMegamorphicCache(vm);
+    clearMethodCache(vm);
+    // Get rid of string table items if needed.
+    tableRemoveWhite(&vm->strings);
+    removeWhiteRemembered(vm);
+    // Get rid of all white (unmarked items) objects, a few pages at a time from now on.
+    startSweep(vm);
+    // The sweep only resets the old generation's marks.
+    unmarkNursery(vm);
+
+    vm->gcState = GC_SWEEPING;
+    vm->nextGC = vm->bytesAllocated + GC_STEP_SIZE;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc marked, sweeping\n");
+#endif
+}
+
+/**
+ * @brief Do one incremental step of the full GC, starting a cycle if one isn't running.
+ * Called whenever bytesAllocated passes nextGC.
+ */
+void gcStep(VM* vm) {
+    uint64_t deadline = nowMicros() + vm->gcPauseBudget;
+
+    if (vm->gcState == GC_SWEEPING) {
+        if (sweepSome(vm, deadline)) {
+            finishSweep(vm);
+        } else {
+            vm->nextGC = vm->bytesAllocated + GC_STEP_SIZE;
+        }
+        return;
+    }
+
+    if (vm->gcState == GC_IDLE) startCycle(vm);
+
+    if (markSome(vm, deadline)) {
+        finishCycle(vm);
+    } else {
+        vm->nextGC = vm->bytesAllocated + GC_STEP_SIZE;
+    }
+}
+
+/**
+ * @brief Run a whole full GC now, finishing the current cycle if there is one.
+ */
+void collectGarbage(VM* vm) {
+    if (vm->gcState == GC_SWEEPING) {
+        sweepSome(vm, UINT64_MAX);
+        finishSweep(vm);
+    }
+    if (vm->gcState == GC_IDLE) startCycle(vm);
+    traceReferences(vm);
+    finishCycle(vm);
+    sweepSome(vm, UINT64_MAX);
+    finishSweep(vm);
+}
+
+/**
+ * @brief Free every object in a list of pages, and the pages.
+ * @param page the list's head
+ */
+static void freePages(VM* vm, Page* page) {
+    walkPages(vm, page, freeObjectContents);
+    while (page != NULL) {
+        Page* next = page->next;
+        freePage(page);
+        page = next;
+    }
+}
+
+void freeObjects(VM* vm) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        freePages(vm, vm->pools[i].pages);
+        freePages(vm, vm->pools[i].unswept);
+        vm->pools[i].pages = NULL;
+        vm->pools[i].unswept = NULL;
+        vm->pools[i].current = NULL;
+    }
+    freePages(vm, vm->largePages);
+    freePages(vm, vm->largeUnswept);
+    vm->largePages = NULL;
+    vm->largeUnswept = NULL;
+
+    walkNursery(vm, freeObjectContents);
+    while (vm->nursery != NULL) {
+        NurseryBlock* block = vm->nursery;
+        vm->nursery = block->next;
+        free(block);
     }
 
-    free(vm.grayStack);
+    stopMarkThreads(vm);
+    free(vm->grayStack);
+    free(vm->remembered);
 }
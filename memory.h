@@ -3,26 +3,74 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
       sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+// Bytes of young objects allocated between minor GCs. Must be a power of 2, blocks are aligned to it.
+#define NURSERY_SIZE (256 * 1024)
+// Objects bigger than this, which are only ever long strings, skip the nursery and start out old.
+#define MAX_YOUNG_SIZE 4096
+// Longest an incremental marking step runs for, in microseconds. The VM's gcPauseBudget starts out as this.
+#define GC_PAUSE_BUDGET_US 500
+// Bytes allocated between incremental marking steps.
+#define GC_STEP_SIZE (64 * 1024)
+// Threads that mark in parallel, counting the VM's own. The VM's gcThreads starts out as this, 1 keeps marking serial.
+#define GC_THREADS 1
+#define GC_THREADS_MAX 64
+// Smaller heaps always mark on one thread, waking the others would cost more than it saves.
+#define PARALLEL_MARK_MIN_HEAP (32 * 1024 * 1024)
+// Percent of the old generation's pool pages that can be free slots before a compaction. The VM's compactThreshold starts out as this, 0 turns compaction off.
+#define COMPACT_THRESHOLD 50
+// Pools smaller than this are never compacted.
+#define COMPACT_MIN_HEAP (4 * 1024 * 1024)
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+Obj* allocateYoung(VM* vm, size_t size);
+Obj* allocateTenured(VM* vm, size_t size);
+void initPools(VM* vm);
+void initNursery(VM* vm);
+void rememberObject(VM* vm, Obj* object);
+bool isMarked(Obj* object);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void collectNursery(VM* vm);
+void gcStep(VM* vm);
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
+
+/**
+ * @brief Write barrier, call it after storing value somewhere in owner.
+ * Old objects that point at young ones go in the remembered set, so a minor GC can find
+ * everything the old generation keeps alive without looking through all of it. While the full
+ * GC is marking, the value gets shaded gray if owner has already been marked.
+ * @param vm VM owning both objects
+ * @param owner object written to, NULL for globals and the VM's other roots
+ * @param value value stored
+ */
+static inline void writeBarrier(VM* vm, Obj* owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* object = AS_OBJ(value);
+
+    if (owner != NULL && object->isYoung && !owner->isYoung && !owner->isRemembered) {
+        rememberObject(vm, owner);
+    }
+    if (vm->gcState == GC_MARKING && (owner == NULL || isMarked(owner)) && !isMarked(object)) {
+        markObject(vm, object);
+    }
+}
 
 #endif
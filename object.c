@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -7,16 +8,22 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+/**
+ * @brief Allocate a new object in the nursery, or straight into the old generation if it's too big
+ * to be worth copying out of the nursery later.
+ * Only run() moves young objects, at its safepoints, so callers can hold on to the new object
+ * across other allocations as long as the GC can reach it.
+ */
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    bool young = size <= MAX_YOUNG_SIZE;
+    Obj* object = young ? allocateYoung(vm, size) : allocateTenured(vm, size);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isYoung = young;
+    object->isRemembered = false;
+    object->isForwarded = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -25,115 +32,413 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+static ObjShape* newShape(VM* vm, ObjClass* klass, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    shape->transitions.owner = (Obj*)shape;
+    return shape;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->methods.owner = (Obj*)klass;
+    klass->initializer = NULL;
+    klass->rootShape = NULL;
+    klass->fieldHint = 0;
+
+    push(vm, OBJ_VAL(klass)); // Keep the class around while allocating its root shape.
+    klass->rootShape = newShape(vm, klass, NULL, NULL);
+    pop(vm);
     return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*)allocateObject(vm,
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
-ObjFunction* newFunction() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     initChunk(&function->chunk);
+    function->chunk.constants.owner = (Obj*)function;
     return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    // Size the inline field storage off the biggest instance of the class so far,
+    // so instances built by the same init() fit without another allocation.
+    int capacity = klass->fieldHint;
+    ObjInstance* instance = (ObjInstance*)allocateObject(vm,
+        sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->slotTable = NULL;
+    instance->fields = instance->inlineFields;
+    instance->fieldCount = 0;
+    instance->fieldCapacity = capacity;
+    instance->inlineCapacity = capacity;
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+/**
+ * @brief Walk up a shape's parents looking for the shape that added a field.
+ * @param shape shape to search
+ * @param name field name
+ * @return slot of the field, or -1 if the shape doesn't have it
+ */
+static int shapeFindSlot(ObjShape* shape, ObjString* name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Get the shape for adding a field to a shape, creating it the first time that field is added.
+ * @param shape shape the instance has now, must be reachable by the GC
+ * @param name field being added
+ * @return child shape with the new field in the next slot
+ */
+static ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name) {
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) return AS_SHAPE(child);
+
+    ObjShape* next = newShape(vm, shape->klass, shape, name);
+    push(vm, OBJ_VAL(next));
+    tableSet(vm, &shape->transitions, name, OBJ_VAL(next));
+    pop(vm);
+    return next;
+}
+
+/**
+ * @brief Find which slot of an instance's fields holds a field
+ * @param instance instance to search
+ * @param name field name
+ * @return slot of the field, or -1 if the instance doesn't have it
+ */
+int instanceFindSlot(ObjInstance* instance, ObjString* name) {
+    if (instance->shape != NULL) return shapeFindSlot(instance->shape, name);
+
+    Value slot;
+    if (tableGet(instance->slotTable, name, &slot)) return (int)AS_NUMBER(slot);
+    return -1;
+}
+
+/**
+ * @brief Move an instance to dictionary mode, where its own table maps field names to slots.
+ * Used once an instance has too many fields for shapes to be worth it.
+ * @param instance instance to convert
+ */
+static void makeDictionary(VM* vm, ObjInstance* instance) {
+    Table* slotTable = ALLOCATE(vm, Table, 1);
+    initTable(slotTable);
+    slotTable->owner = (Obj*)instance;
+    instance->slotTable = slotTable;
+
+    for (ObjShape* shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+        tableSet(vm, slotTable, shape->name, NUMBER_VAL(shape->fieldCount - 1));
+    }
+    instance->shape = NULL;
+}
+
+/**
+ * @brief Add a field the instance doesn't have yet, moving it to the next shape
+ * @param instance instance to add to, must be reachable by the GC
+ * @param name field name
+ * @param value field value, must be reachable by the GC
+ */
+void instanceAddField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+    // Do anything that can allocate first, so the GC never sees a half added field.
+    if (instance->fieldCount == instance->fieldCapacity) {
+        // Outgrew the inline slots, move the fields out to their own array.
+        int oldCapacity = instance->fieldCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if (instance->fields == instance->inlineFields) {
+            Value* fields = ALLOCATE(vm, Value, capacity);
+            memcpy(fields, instance->inlineFields, sizeof(Value) * instance->fieldCount);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(vm, Value, instance->fields, oldCapacity, capacity);
+        }
+        instance->fieldCapacity = capacity;
+    }
+
+    int slot = instance->fieldCount;
+    if (instance->shape != NULL && slot >= MAX_SHAPE_FIELDS) {
+        makeDictionary(vm, instance);
+    }
+
+    if (instance->shape != NULL) {
+        instance->shape = shapeTransition(vm, instance->shape, name);
+    } else {
+        tableSet(vm, instance->slotTable, name, NUMBER_VAL(slot));
+    }
+
+    instance->fields[slot] = value;
+    instance->fieldCount++;
+    writeBarrier(vm, (Obj*)instance, value);
+    if (instance->shape != NULL) writeBarrier(vm, (Obj*)instance, OBJ_VAL(instance->shape));
+
+    if (instance->fieldCount > instance->klass->fieldHint && instance->fieldCount <= MAX_SHAPE_FIELDS) {
+        instance->klass->fieldHint = instance->fieldCount;
+    }
+}
+
+ObjNative* newNative(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/**
+ * @brief Allocate a flat string with room for length characters, for the caller to fill in.
+ */
+static ObjString* allocateString(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->isRope = false;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    push(OBJ_VAL(string)); // Keep value in stack before allocation to prevent GC removing it.
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+/**
+ * @brief Add a new string to the intern table.
+ * @param string string with its characters and hash filled in
+ */
+static ObjString* intern(VM* vm, ObjString* string) {
+    push(vm, OBJ_VAL(string)); // Keep value in stack before allocation to prevent GC removing it.
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 
+// Multipliers for hashString(), from wyhash.
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+/**
+ * @brief Multiply two 64 bit numbers and fold the 128 bit product back down, hashString's mixing step.
+ */
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    // No 128 bit integers, build the product from 32 bit halves. Gives the same hash.
+    uint64_t aLow = a & 0xffffffff, aHigh = a >> 32;
+    uint64_t bLow = b & 0xffffffff, bHigh = b >> 32;
+    uint64_t lowLow = aLow * bLow;
+    uint64_t highLow = aHigh * bLow;
+    uint64_t lowHigh = aLow * bHigh;
+    uint64_t cross = (lowLow >> 32) + (highLow & 0xffffffff) + lowHigh;
+    uint64_t high = aHigh * bHigh + (highLow >> 32) + (cross >> 32);
+    uint64_t low = (cross << 32) | (lowLow & 0xffffffff);
+    return low ^ high;
+#endif
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
 /**
- * @brief Use FNV-1a hash algorithm to calculate a string's hash value
+ * @brief Calculate a string's hash value, wyhash style - 8 bytes at a time, mixed with 64 bit multiplies.
+ * The low bits are as well mixed as the high ones, which matters since tables mask the hash down
+ * to a power of 2.
  * @param key the string to hash
  * @param length the length of the string
  * @return the hashed string
  */
 static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
-    return hash;
-}
+    const uint8_t* p = (const uint8_t*)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = hashMix(HASH_P0, HASH_P1);
+    uint64_t a, b;
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-
-    if (interned != NULL) {
-        // Free the string just passed in.
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    if (remaining <= 16) {
+        // Short strings are read as (possibly overlapping) words from both ends.
+        if (remaining >= 4) {
+            size_t middle = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        if (remaining > 48) {
+            // Three independent lanes, so the multiplies can overlap.
+            uint64_t lane1 = seed;
+            uint64_t lane2 = seed;
+            do {
+                seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                lane1 = hashMix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ lane1);
+                lane2 = hashMix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while (remaining > 16) {
+            seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes, overlapping what's already been mixed in.
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return allocateString(chars, length, hash);
+
+    return (uint32_t)hashMix(HASH_P1 ^ (uint64_t)length, hashMix(a ^ HASH_P1, b ^ seed));
 }
 
 /**
- * @brief Create a copy of a string passed in, to give ownership
+ * @brief Get the interned string with the given characters, copying them into a new string if there isn't one
  * @param chars 
  * @param length 
  * @return 
  */
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     // Check if the string exists in string table - return that if so
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(vm, length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return intern(vm, string);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+/**
+ * @brief Copy a string's characters into a buffer, walking the halves of a rope.
+ * Fills the buffer from the end, so ropes built by appending in a loop, which nest on the left,
+ * only ever have one half waiting to be copied.
+ * @param string string to copy
+ * @param dest buffer with room for string->length characters
+ */
+static void copyChars(ObjString* string, char* dest) {
+    char* end = dest + string->length;
+    ObjString** pending = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    for (;;) {
+        ObjRope* rope = (ObjRope*)string;
+        if (!string->isRope) {
+            end -= string->length;
+            memcpy(end, string->chars, string->length);
+            if (count == 0) break;
+            string = pending[--count];
+        } else if (rope->right == NULL) {
+            string = rope->left; // Already flattened.
+        } else {
+            if (count == capacity) {
+                capacity = GROW_CAPACITY(capacity);
+                pending = (ObjString**)realloc(pending, sizeof(ObjString*) * capacity);
+                if (pending == NULL) exit(1);
+            }
+            pending[count++] = rope->left;
+            string = rope->right;
+        }
+    }
+    free(pending);
+}
+
+/**
+ * @brief Concatenate two strings. Short results are copied and interned like any other string,
+ * long ones become a rope so building a string up in a loop doesn't copy it every time.
+ * @param a first string, must be reachable by the GC
+ * @param b second string, must be reachable by the GC
+ * @return the concatenation
+ */
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b) {
+    // A flattened rope stands in for its flat string, so the new rope doesn't hang on to its halves.
+    if (a->isRope && ((ObjRope*)a)->right == NULL) a = ((ObjRope*)a)->left;
+    if (b->isRope && ((ObjRope*)b)->right == NULL) b = ((ObjRope*)b)->left;
+
+    int length = a->length + b->length;
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_STRING);
+        rope->length = length;
+        rope->hash = 0;
+        rope->isRope = true;
+        rope->left = a;
+        rope->right = b;
+        return (ObjString*)rope;
+    }
+
+    char chars[ROPE_MIN_LENGTH];
+    copyChars(a, chars);
+    copyChars(b, chars + a->length);
+    return copyString(vm, chars, length);
+}
+
+/**
+ * @brief Get the interned flat version of a string, copying a rope's characters out the first time.
+ * @param string string to flatten, must be reachable by the GC
+ * @return flat string with the same characters
+ */
+ObjString* flattenString(VM* vm, ObjString* string) {
+    if (!string->isRope) return string;
+    ObjRope* rope = (ObjRope*)string;
+    if (rope->right == NULL) return rope->left;
+
+    // Copy into a new string and look that up, the copy is just garbage if it's interned already.
+    ObjString* flat = allocateString(vm, rope->length);
+    copyChars(string, flat->chars);
+    flat->hash = hashString(flat->chars, flat->length);
+    ObjString* interned = tableFindString(&vm->strings, flat->chars, flat->length, flat->hash);
+    flat = interned != NULL ? interned : intern(vm, flat);
+
+    rope->left = flat;
+    rope->right = NULL;
+    writeBarrier(vm, (Obj*)rope, OBJ_VAL(flat));
+    return flat;
+}
+
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
@@ -168,9 +473,23 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
-        case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
+        case OBJ_STRING: {
+            ObjString* string = AS_STRING(value);
+            if (!string->isRope) {
+                printf("%s", string->chars);
+                break;
+            }
+            // Print a rope from a scratch copy, flattening would allocate on the GC heap.
+            char* chars = (char*)malloc(string->length);
+            if (chars == NULL) exit(1);
+            copyChars(string, chars);
+            printf("%.*s", string->length, chars);
+            free(chars);
             break;
+        }
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
@@ -14,7 +14,9 @@
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)          (IS_STRING(value) && AS_STRING(value)->isRope)
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
@@ -22,8 +24,10 @@
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+#define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars) //< Only for flat strings, see flattenString().
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -32,38 +36,67 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    bool isYoung; //< Still in the nursery. Young objects move when a minor GC promotes them.
+    bool isRemembered; //< Old object in the remembered set, see writeBarrier().
+    bool isForwarded; //< Young object that's been promoted, its old generation address is stored after the header.
 };
 
+typedef struct JitCode JitCode;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxSlots; //< Most stack slots a frame of the function uses at once, counting the callee and arguments.
     Chunk chunk;
     ObjString* name;
+    int hotness; //< Calls and loop iterations so far, the function gets compiled once this hits JIT_THRESHOLD.
+    JitCode* jit; //< Native code for the function, NULL if it hasn't been compiled.
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args); //< Gets the VM calling it, so it can allocate.
 
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
+// Concatenations shorter than this are copied straight away, longer ones build a rope.
+#define ROPE_MIN_LENGTH 64
+
+/**
+ * @brief A flat string, its characters stored inline after the header. Flat strings are interned.
+ * A string can also be an ObjRope, see isRope.
+ */
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    bool isRope; //< The string is an ObjRope, with no characters of its own.
+    char chars[]; //< length characters and a '\0'.
 };
 
+/**
+ * @brief A concatenation that hasn't been copied out yet, laid out like an ObjString up to isRope.
+ * Flattening a rope interns its contents and points left at the result, with right set to NULL.
+ * Ropes are never table keys, every name the VM looks up comes from a constant.
+ */
+typedef struct {
+    Obj obj;
+    int length;
+    uint32_t hash; //< Unused.
+    bool isRope; //< Always true.
+    ObjString* left; //< First half, or the flat string once it's been flattened.
+    ObjString* right; //< Second half, NULL once it's been flattened.
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -73,32 +106,59 @@ typedef struct ObjUpvalue {
 
 /**
  * @brief Struct to capture local variables from functions
- * All functions get wrapped in this, even if they don't capture local vars.
- * Makes things easier for us though.
+ * Only functions with upvalues and methods get wrapped in this, other functions are called as a bare
+ * ObjFunction. A method that captures nothing shares one closure the compiler makes for it.
  */
 typedef struct {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues; //< Closures may have different number of upvalues, so dynamic array needed. Upvalues also are dynamically allocated, so double pointer time.
     int upvalueCount;
+    ObjUpvalue* upvalues[]; //< upvalueCount upvalues, stored inline so a closure is a single allocation.
 } ObjClosure;
 
+// Instances with more fields than this stop getting new shapes and fall back to dictionary mode.
+#define MAX_SHAPE_FIELDS 64
+
+/**
+ * @brief Hidden class describing the fields an instance has, and which slot each one is stored in.
+ * Every class has a tree of shapes. The root has no fields and each child adds one field to its parent,
+ * so instances that get the same fields in the same order (usually in init()) share a shape.
+ */
+struct ObjShape {
+    Obj obj;
+    ObjClass* klass; //< Class whose instances use this shape.
+    struct ObjShape* parent; //< Shape without `name`, NULL for the root shape.
+    ObjString* name; //< Field this shape adds to its parent. It lives in slot fieldCount - 1.
+    int fieldCount; //< Number of fields an instance with this shape has.
+    Table transitions; //< Field name -> child shape adding that field.
+};
+
 /**
  * @brief Object to hold a class representation.
  */
-typedef struct {
+struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
-} ObjClass;
+    ObjClosure* initializer; //< The init() method, NULL if the class doesn't have one. Saves looking it up for every new instance.
+    ObjShape* rootShape; //< Shape new instances start out with.
+    int fieldHint; //< Most fields an instance has had, used to size the inline field storage of new instances.
+};
 
 /**
  * @brief Struct defining an instance of a class.
+ * Field values are stored densely by slot, with the shape mapping names to slots.
  */
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields; //< Hash table of the fields for fast lookup.
+    ObjShape* shape; //< Hidden class of the instance, NULL once it's in dictionary mode.
+    Table* slotTable; //< Dictionary mode only - field name -> slot.
+    Value* fields; //< Field values by slot. Points at inlineFields until the instance outgrows them.
+    int fieldCount; //< Number of fields in use.
+    int fieldCapacity; //< Number of slots fields can hold.
+    int inlineCapacity; //< Number of slots allocated with the instance itself.
+    Value inlineFields[];
 } ObjInstance;
 
 /**
@@ -110,16 +170,19 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
-
-ObjClass* newClass(ObjString* name);
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+int instanceFindSlot(ObjInstance* instance, ObjString* name);
+void instanceAddField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+ObjNative* newNative(VM* vm, NativeFn function);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b);
+ObjString* flattenString(VM* vm, ObjString* string);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 void printObject(Value value);
 
 // Need to use a function because value is used twice.
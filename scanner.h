@@ -30,7 +30,13 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+    const char* start; ///< beginning of current lexeme being scanned
+    const char* current; ///< current character being looked at
+    int line; ///< what line the lexeme is on, used for error reporting
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
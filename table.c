@@ -6,52 +6,151 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Each entry has a control byte: CONTROL_EMPTY, CONTROL_DELETED, or the top 7 bits of the key's
+ * hash when it's full. Probing reads the control bytes a group of GROUP_WIDTH at a time, checks
+ * the whole group for the hash fragment at once, and only looks at the entries whose byte matches.
+ * A group with an empty entry in it ends the probe.
+ * The control array has GROUP_WIDTH bytes past the end copying the first ones, so a group
+ * starting near the end reads on round to the start of the table.
+ */
+
+/*
+ * Tables of up to TABLE_SMALL_CAPACITY entries have no control bytes at all. Keys are appended in
+ * order and found by scanning the first count entries, comparing pointers since keys are interned.
+ * Deleting leaves a hole that's packed away the next time the table runs out of room.
+ */
+
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define HASH_FRAGMENT(hash) ((uint8_t)((hash) >> 25))
+
+#if defined(__SSE2__)
+
+// Bit i is set if control byte i of the group is byte.
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+}
+
+// Bit i is set if control byte i of the group is empty or deleted - the only ones with the top bit set.
+static inline uint32_t matchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    uint32_t matches = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == byte) matches |= 1u << i;
+    }
+    return matches;
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {
+    uint32_t matches = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) matches |= 1u << i;
+    }
+    return matches;
+}
+
+#endif
+
+// Index of the lowest set bit of a group's match mask, which mustn't be 0.
+static inline uint32_t firstMatch(uint32_t matches) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_ctz(matches);
+#else
+    uint32_t index = 0;
+    while ((matches & 1) == 0) {
+        matches >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->deleted = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+    table->owner = NULL;
+}
+
+static inline bool isSmall(int capacity) {
+    return capacity <= TABLE_SMALL_CAPACITY;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    if (table->control != NULL) FREE_ARRAY(vm, uint8_t, table->control, table->capacity + GROUP_WIDTH);
     initTable(table);
 }
 
 /**
- * @brief Take a key and an array of buckets, and figure out which bucket the entry belongs to
- * @param entries 
- * @param capacity 
+ * @brief Set an entry's control byte, and its copies past the end of the array.
+ * Tables smaller than a group have more than one copy.
+ */
+static inline void setControl(uint8_t* control, int capacity, int index, uint8_t byte) {
+    control[index] = byte;
+    for (int copy = index + capacity; copy < capacity + GROUP_WIDTH; copy += capacity) {
+        control[copy] = byte;
+    }
+}
+
+/**
+ * @brief Take a key and the table's buckets, and figure out which bucket holds it
+ * @param table 
  * @param key 
- * @return 
+ * @return index of the key's entry, or -1 if it isn't in the table
  */
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    // uint32_t index = key->hash % capacity; - Old slow modulo way
-    uint32_t index = key->hash & (capacity - 1); // Cooler bitmask way, since we're always a power of 2.
-    Entry* tombstone = NULL;
+static int findEntry(Table* table, ObjString* key) {
+    Entry* entries = table->entries;
+    if (table->control == NULL) {
+        for (int i = 0; i < table->count; i++) {
+            if (entries[i].key == key) return i;
+        }
+        return -1;
+    }
+
+    const uint8_t* control = table->control;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = key->hash & mask; // Bitmask rather than modulo, since we're always a power of 2.
+    uint8_t fragment = HASH_FRAGMENT(key->hash);
 
     for (;;) {
-        Entry* entry = &entries[index];
-        // If key is available, we return it, we have it stored.
-        // If key is NULL - it's either not stored, a tombstone (with value true), or available to be used to insert
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry. Can use a tombstone if one available
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+        const uint8_t* group = &control[index];
+        for (uint32_t matches = matchByte(group, fragment); matches != 0; matches &= matches - 1) {
+            uint32_t candidate = (index + firstMatch(matches)) & mask;
+            if (entries[candidate].key == key) return (int)candidate;
         }
+        // The key would have gone in the empty entry, so it isn't here.
+        if (matchByte(group, CONTROL_EMPTY) != 0) return -1;
+        index = (index + GROUP_WIDTH) & mask;
+    }
+}
 
-        // Otherwise, we have a collision - start using linear probing
-        // We insert in the next available bucket we can, wrapping if we reach the end.
-        //index = (index + 1) % capacity;
-        index = (index + 1) & (capacity - 1);
+/**
+ * @brief Find where a new key goes, the first empty or deleted entry along its probe sequence.
+ * @return index of the entry
+ */
+static int findFreeEntry(const uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = hash & mask;
+
+    for (;;) {
+        uint32_t free = matchFree(&control[index]);
+        if (free != 0) return (int)((index + firstMatch(free)) & mask);
+        index = (index + GROUP_WIDTH) & mask;
     }
 }
 
@@ -65,39 +164,85 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findEntry(table, key);
+    if (index < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = ALLOCATE(vm, Entry, capacity);
+    uint8_t* control = NULL;
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    if (!isSmall(capacity)) {
+        control = ALLOCATE(vm, uint8_t, capacity + GROUP_WIDTH);
+        memset(control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
+    }
 
     // Re-insert every entry if we're resizing, due to bucket placement being based off array size
-    // Don't copy over tombstones to save space.
+    // Don't copy over deleted entries to save space.
     table->count = 0;
+    table->deleted = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int dest = control == NULL ? table->count : findFreeEntry(control, capacity, entry->key->hash);
+        entries[dest] = *entry;
+        if (control != NULL) setControl(control, capacity, dest, HASH_FRAGMENT(entry->key->hash));
         table->count++;
     }
 
-    // Free the old array
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    // Free the old arrays
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    if (table->control != NULL) FREE_ARRAY(vm, uint8_t, table->control, table->capacity + GROUP_WIDTH);
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
+/**
+ * @brief Find room for a key that isn't in the table, resizing it first if the load policy says so.
+ * @return index of the entry, counted as used
+ */
+static int insertEntry(VM* vm, Table* table, ObjString* key) {
+    int live = table->count - table->deleted;
+    bool full = table->control == NULL ?
+        table->count == table->capacity : table->count + 1 > table->capacity * TABLE_MAX_LOAD;
+
+    if (full) {
+        // Rehash at the same size if that clears out enough deleted entries, grow otherwise.
+        bool enoughRoom = table->control == NULL ?
+            table->deleted > 0 : live + 1 <= table->capacity * TABLE_MAX_LOAD / 2;
+        int capacity = enoughRoom ? table->capacity :
+            table->capacity == 0 ? 1 : table->capacity * 2;
+        adjustCapacity(vm, table, capacity);
+    } else if (table->capacity > TABLE_MIN_CAPACITY && live < table->capacity * TABLE_MIN_LOAD) {
+        // Mostly empty, usually after the GC dropped a lot of strings. Shrink to half full at most.
+        int capacity = table->capacity;
+        while (capacity / 2 >= TABLE_MIN_CAPACITY && live + 1 <= capacity / 2 * TABLE_MAX_LOAD / 2) {
+            capacity /= 2;
+        }
+        adjustCapacity(vm, table, capacity);
+    }
+
+    if (table->control == NULL) return table->count++;
+
+    int index = findFreeEntry(table->control, table->capacity, key->hash);
+    // Only count empty entries - deleted ones were counted when their key first went in.
+    if (table->control[index] == CONTROL_EMPTY) {
+        table->count++;
+    } else {
+        table->deleted--;
+    }
+    setControl(table->control, table->capacity, index, HASH_FRAGMENT(key->hash));
+    return index;
+}
+
 /**
  * @brief Add a key/value pair to a hash table
  * @param table 
@@ -105,20 +250,18 @@ static void adjustCapacity(Table* table, int capacity) {
  * @param value 
  * @return true/false if the key is new or not
  */
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table,capacity);
-    }
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+    int index = table->count == 0 ? -1 : findEntry(table, key);
+    bool isNewKey = index < 0;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    // Only increment if empty and not tombstone - we count tombstones as full buckets and
-    // they're counted when the initial entry goes in before they become a tombstone.
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    if (isNewKey) {
+        index = insertEntry(vm, table, key);
+        table->entries[index].key = key;
+    }
 
-    entry->key = key;
-    entry->value = value;
+    table->entries[index].value = value;
+    writeBarrier(vm, table->owner, OBJ_VAL(key));
+    writeBarrier(vm, table->owner, value);
     return isNewKey;
 }
 
@@ -126,15 +269,17 @@ bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findEntry(table, key);
+    if (index < 0) return false;
 
-    // Place a tombstone in the entry - Used to prevent gaps in the linear probe
+    // Mark the entry deleted rather than empty - Used to prevent gaps in the probe
     // Imagine 3 elements all want to be in bucket 2. [1, 2, 3]. If we delete 2,
-    // and assume an empty element means we're done probing, we'd never find 3.
-    // A tombstone is a sential value used to keep probing. It has key NULL and value true
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // and an empty entry meant we're done probing, we'd never find 3.
+    // Small tables just leave a hole, they don't move entries while the GC might be walking them.
+    if (table->control != NULL) setControl(table->control, table->capacity, index, CONTROL_DELETED);
+    table->deleted++;
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
     return true;
 }
 
@@ -143,11 +288,11 @@ bool tableDelete(Table* table, ObjString* key) {
  * @param from 
  * @param to 
  */
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i ++){
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -163,20 +308,32 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    //uint32_t index = hash % table->capacity;
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it!
-            return entry->key;
+    if (table->control == NULL) {
+        for (int i = 0; i < table->count; i++) {
+            ObjString* key = table->entries[i].key;
+            if (key != NULL && key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        return NULL;
+    }
 
-        //index = (index + 1) % table->capacity;
-        index = (index + 1) & (table->capacity - 1);
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
+    uint8_t fragment = HASH_FRAGMENT(hash);
+    for (;;) {
+        const uint8_t* group = &table->control[index];
+        for (uint32_t matches = matchByte(group, fragment); matches != 0; matches &= matches - 1) {
+            ObjString* key = table->entries[(index + firstMatch(matches)) & mask].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                // We found it!
+                return key;
+            }
+        }
+        // Stop once the group has an empty entry.
+        if (matchByte(group, CONTROL_EMPTY) != 0) return NULL;
+        index = (index + GROUP_WIDTH) & mask;
     }
 }
 
@@ -188,16 +345,16 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !isMarked((Obj*)entry->key)) {
             tableDelete(table, entry->key);
         }
     }
 }
 
-void markTable(Table* table) {
+void markTable(VM* vm, Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj*)entry->key);
+        markValue(vm, entry->value);
     }
 }
\ No newline at end of file
@@ -4,6 +4,16 @@
 #include "common.h"
 #include "value.h"
 
+// Most of a table's entries that can be in use, counting deleted ones, before inserting rehashes it.
+// The rehash grows the table, or keeps its size if getting rid of deleted entries frees up enough.
+#define TABLE_MAX_LOAD 0.75
+// Fewest of a table's entries that can hold keys before inserting shrinks it.
+#define TABLE_MIN_LOAD 0.125
+// Tables never shrink below this many entries.
+#define TABLE_MIN_CAPACITY 8
+// Tables this size or smaller skip hashing and scan their entries in order, see table.c.
+#define TABLE_SMALL_CAPACITY 8
+
 // Struct that holds a key/value pair for a hash table.
 typedef struct {
     ObjString* key;
@@ -11,20 +21,25 @@ typedef struct {
 } Entry;
 
 // Hash table, with an array of Entry, and the count and capacity of the struct.
+// Empty and deleted entries have a NULL key. The control bytes say which is which, see table.c.
+// Small tables have no control bytes.
 typedef struct {
-    int count;
+    int count; //< Entries in use, counting deleted ones.
+    int deleted; //< Deleted entries, which still take up room until the table is rehashed.
     int capacity;
     Entry* entries;
+    uint8_t* control; //< A control byte per entry, then copies of the first ones so a group read can run off the end. NULL for small tables.
+    Obj* owner; //< Object the table belongs to, for the GC's write barrier. NULL for the VM's own tables.
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
-void markTable(Table* table);
+void markTable(VM* vm, Table* table);
 
 #endif
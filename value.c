@@ -14,6 +14,7 @@ void initValueArray(ValueArray* array) {
     array->values = NULL;
     array->capacity = 0;
     array->count = 0;
+    array->owner = NULL;
 }
 
 /**
@@ -21,15 +22,16 @@ void initValueArray(ValueArray* array) {
  * @param array The array to write the value to
  * @param value The value to add to the array
  */
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
+    writeBarrier(vm, array->owner, value);
 }
 
 /**
@@ -37,8 +39,8 @@ void writeValueArray(ValueArray* array, Value value) {
  * @param array The value array to free
 
  */
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -65,6 +67,8 @@ void printValue(Value value) {
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: break;
+        case VAL_LAZY_BOUND: break; // The VM prints these, it knows what they're bound to.
     }
 #endif
 }
@@ -85,6 +89,8 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
+        case VAL_LAZY_BOUND: return AS_LAZY_BOUND(a) == AS_LAZY_BOUND(b);
         default:            return false; // Unreachable.
     }
 #endif
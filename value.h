@@ -7,6 +7,9 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 // We're hacking big now, and throwing all types into a 64 bit type. 64 bit pointers only really use 48 bits, 
@@ -20,6 +23,8 @@ typedef struct ObjString ObjString;
 #define TAG_NIL     1 // 01.
 #define TAG_FALSE   2 // 10.
 #define TAG_TRUE    3 // 11.
+#define TAG_UNDEFINED 0 // 00.
+#define TAG_LAZY_BOUND ((uint64_t)1 << 49) //< Set on top of QNAN for a lazily bound method, its index in the low bits.
 
 typedef uint64_t Value;
 
@@ -27,17 +32,22 @@ typedef uint64_t Value;
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_LAZY_BOUND(value) (((value) & (SIGN_BIT | QNAN | TAG_LAZY_BOUND)) == (QNAN | TAG_LAZY_BOUND))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL) // If not true, it's false.
 #define AS_NUMBER(value)    valueToNum(value)
 #define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN))) // Get rid of sign and qnan bits to get the object pointer.
+#define AS_LAZY_BOUND(value) ((int)(uint32_t)(value))
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL: FALSE_VAL)
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE)) 
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE)) 
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL)) // Cast dance and bitwise or with QNAN and 1st bit set.
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define LAZY_BOUND_VAL(index) ((Value)(QNAN | TAG_LAZY_BOUND | (uint32_t)(index)))
 
 static inline double valueToNum(Value value) {
     double num;
@@ -61,6 +71,8 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ, //< Heap pointer for larger objects
+    VAL_UNDEFINED, //< Global slot that hasn't been defined yet, never seen by Lox code
+    VAL_LAZY_BOUND, //< Method bound without an ObjBoundMethod, only ever on the VM's stack. See LazyBound in vm.h.
 } ValueType;
 
 typedef struct {
@@ -69,6 +81,7 @@ typedef struct {
         bool boolean;
         double number;
         Obj* obj;
+        int lazyBound;
     } as;
 } Value;
 
@@ -77,17 +90,22 @@ typedef struct {
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_LAZY_BOUND(value) ((value).type == VAL_LAZY_BOUND)
 
 // Cast a value macros
 #define AS_OBJ(value)       ((value).as.obj)
 #define AS_BOOL(value)      ((value).as.boolean)
 #define AS_NUMBER(value)    ((value).as.number)
+#define AS_LAZY_BOUND(value) ((value).as.lazyBound)
 
 // Print an value macros
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
+#define LAZY_BOUND_VAL(index) ((Value){VAL_LAZY_BOUND, {.lazyBound = index}})
 
 #endif
 
@@ -98,12 +116,13 @@ typedef struct {
     int capacity; ///< Maximum size of the array
     int count; ///< Number of elements allocated in values array
     Value* values; ///< Array of actual values
+    Obj* owner; ///< Object the array belongs to, for the GC's write barrier. NULL for the VM's own arrays.
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 void printValue(Value value);
 
 #endif
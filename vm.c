@@ -1,51 +1,66 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 
-VM vm;
-
-static Value clockNative(int argCount, Value* args) {
+static Value clockNative(VM* vm, int argCount, Value* args) {
+    (void)vm;
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
 /**
  * @brief Reset the stackTop pointer to the beginning of the stack.
  */
-static void resetStack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        vm->openUpvalueSlots[upvalue->location - vm->stack] = NULL;
+    }
+    vm->openUpvalues = NULL;
+    reclaimLazyBounds(vm);
+}
+
+static void printFrame(CallFrame* frame) {
+    ObjFunction* function = frame->function;
+    size_t instruction = frame->ip - function->chunk.code - 1;
+    fprintf(stderr, "[line %d] in ",
+        function->chunk.lines[instruction]);
+    if (function->name == NULL) {
+        fprintf(stderr, "script\n");
+    } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+    // A deep stack only shows its innermost and outermost frames, so a stack overflow stays readable.
+    int skipped = vm->frameCount - TRACE_INNER_FRAMES - TRACE_OUTER_FRAMES;
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        if (skipped > 0 && i == TRACE_OUTER_FRAMES + skipped - 1) {
+            fprintf(stderr, "... %d more frame%s ...\n", skipped, skipped == 1 ? "" : "s");
+            i = TRACE_OUTER_FRAMES - 1;
         }
+        printFrame(frameAt(vm, i));
     }
 
-    resetStack();
+    resetStack(vm);
 }
 
 /**
@@ -53,60 +68,119 @@ static void runtimeError(const char* format, ...) {
  * @param name Name of function in Lox
  * @param function pointer to C function to call
  */
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
+    writeBarrier(vm, NULL, vm->stack[1]);
+    pop(vm);
+    pop(vm);
+}
+
+/**
+ * @brief Get the slot for a global variable, giving it a new, undefined one the first time the name is seen.
+ * Slots are shared by everything compiled in the VM, so a name always maps to the same slot.
+ * @param name Name of the global
+ * @return Index into vm->globalValues
+ */
+int globalSlot(VM* vm, ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(vm, OBJ_VAL(name)); // Keep the name around while the arrays grow.
+    int index = vm->globalValues.count;
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(index));
+    pop(vm);
+    return index;
 }
 
 /**
  * @brief initialize the Virtual machine
  */
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+void initVM(VM* vm) {
+    vm->frameSegments = NULL;
+    vm->frameSegmentCount = 0;
+    vm->frameCapacity = 0;
+    vm->maxFrames = FRAMES_MAX;
+    vm->jitNesting = 0;
+    vm->stackCapacity = STACK_INITIAL;
+    vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm->stackLimit = vm->stack + STACK_INITIAL - STACK_HEADROOM;
+    vm->openUpvalueSlots = (ObjUpvalue**)calloc(STACK_INITIAL, sizeof(ObjUpvalue*));
+    if (vm->stack == NULL || vm->openUpvalueSlots == NULL) exit(1);
+    vm->openUpvalues = NULL;
+    vm->lazyBounds = NULL;
+    vm->lazyBoundCapacity = 0;
+    vm->freeLazyBounds = NULL;
+    vm->freeLazyBoundCount = 0;
+    resetStack(vm);
+    initPools(vm);
+    initNursery(vm);
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
 
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->gcState = GC_IDLE;
+    vm->gcPauseBudget = GC_PAUSE_BUDGET_US;
+    vm->gcThreads = GC_THREADS;
+    vm->compactThreshold = COMPACT_THRESHOLD;
+    vm->compactRequested = false;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->marker = NULL;
+    vm->parser = NULL;
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    initTable(&vm->strings);
+    clearMegamorphicCache(vm);
+    clearMethodCache(vm);
 
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm->initString = NULL;
+    vm->initString = copyString(vm, "init", 4);
 
-    defineNative("clock", clockNative);
+    defineNative(vm, "clock", clockNative);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
-    freeObjects();
+void freeVM(VM* vm) {
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    freeTable(vm, &vm->strings);
+    vm->initString = NULL;
+    freeObjects(vm);
+
+    for (int i = 0; i < vm->frameSegmentCount; i++) {
+        free(vm->frameSegments[i]);
+    }
+    free(vm->frameSegments);
+    free(vm->stack);
+    free(vm->openUpvalueSlots);
+    free(vm->lazyBounds);
+    free(vm->freeLazyBounds);
 }
 
 /**
  * @brief Add a value to the VM's stack, incrementing stackTop afterwords.
  * @param value Value to add to stack
  */
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
-    //TODO: test with *vm.stackTop++ = value;
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
+    //TODO: test with *vm->stackTop++ = value;
 }
 
 /**
  * @brief Return the value at the stackTop pointer after decrementing it, causing the next push() to overwrite the value.
  * @return Value at the stackTop pointer
  */
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 /**
@@ -114,143 +188,544 @@ Value pop() {
  * @param distance How far to look from stackTop, with 0 being equal to stackTop
  * @return Value in the stack
  */
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+#ifdef BASELINE_JIT
+/**
+ * @brief Count a call or loop iteration towards compiling a function, and compile it once it's hot.
+ * Compiling allocates, so vm->stackTop has to be up to date.
+ * @param function 
+ * @return true if the function has native code
+ */
+static inline bool warmUp(VM* vm, ObjFunction* function) {
+    if (function->jit != NULL) return true;
+    if (++function->hotness == JIT_THRESHOLD && !jitCompile(vm, function)) {
+        // Couldn't compile it, don't try again any time soon.
+        function->hotness = INT_MIN;
+    }
+    return function->jit != NULL;
+}
+
+/**
+ * @brief Whether a frame of a function can be run in native code from here.
+ * Each call compiled code makes runs the callee on the C stack, so past JIT_NESTING_MAX they're left
+ * to run()'s loop, where calls don't nest. Deep recursion then stops at maxFrames instead of
+ * overflowing the C stack.
+ */
+static inline bool canEnterJit(VM* vm, ObjFunction* function) {
+    return function->jit != NULL && vm->jitNesting < JIT_NESTING_MAX;
+}
+#endif
+
+/**
+ * @brief Allocate another FRAME_SEGMENT_SIZE frames. Existing frames don't move.
+ */
+static void addFrameSegment(VM* vm) {
+    int segments = vm->frameSegmentCount;
+    CallFrame** frameSegments = (CallFrame**)realloc(vm->frameSegments, sizeof(CallFrame*) * (segments + 1));
+    if (frameSegments == NULL) exit(1);
+    vm->frameSegments = frameSegments;
+    vm->frameSegments[segments] = (CallFrame*)malloc(sizeof(CallFrame) * FRAME_SEGMENT_SIZE);
+    if (vm->frameSegments[segments] == NULL) exit(1);
+    vm->frameSegmentCount++;
+    vm->frameCapacity = vm->frameSegmentCount * FRAME_SEGMENT_SIZE;
+    if (vm->frameCapacity > vm->maxFrames) vm->frameCapacity = vm->maxFrames;
+}
+
+/**
+ * @brief Double the value stack, moving every pointer into it - stackTop, the frames' slots and
+ * open upvalues. Anything else holding a stack pointer across a call has to reload it afterwards,
+ * as run() and compiled code do.
+ */
+static void growStack(VM* vm) {
+    int capacity = vm->stackCapacity * 2;
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    ObjUpvalue** openUpvalueSlots = (ObjUpvalue**)calloc(capacity, sizeof(ObjUpvalue*));
+    if (stack == NULL || openUpvalueSlots == NULL) exit(1);
+
+    int count = (int)(vm->stackTop - vm->stack);
+    memcpy(stack, vm->stack, sizeof(Value) * count);
+    memcpy(openUpvalueSlots, vm->openUpvalueSlots, sizeof(ObjUpvalue*) * count);
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = frameAt(vm, i);
+        frame->slots = stack + (frame->slots - vm->stack);
+    }
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stackTop = stack + count;
+
+    free(vm->stack);
+    free(vm->openUpvalueSlots);
+    vm->stack = stack;
+    vm->openUpvalueSlots = openUpvalueSlots;
+    vm->stackCapacity = capacity;
+    vm->stackLimit = stack + capacity - STACK_HEADROOM;
+}
+
+/**
+ * @brief Make room for one more frame, off call()'s fast path.
+ * @param frameEnd one past the last stack slot the frame can use
+ * @return false on a stack overflow
+ */
+static NOINLINE bool reserveFrame(VM* vm, Value* frameEnd) {
+    if (vm->frameCount == vm->frameCapacity) {
+        if (vm->frameCount >= vm->maxFrames) {
+            runtimeError(vm, "Stack overflow.");
+            return false;
+        }
+        addFrameSegment(vm);
+    }
+    while (frameEnd > vm->stackLimit) {
+        int offset = (int)(frameEnd - vm->stack);
+        growStack(vm);
+        frameEnd = vm->stack + offset;
+    }
+    return true;
 }
 
 /**
  * @brief Sets up a call frame for a function call
  * @param function 
+ * @param closure closure of the function, NULL if it captures nothing
  * @param argCount 
  * @return 
  */
-static bool call(ObjClosure* closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.",
-            closure->function->arity, argCount);
+static bool callFunction(VM* vm, ObjFunction* function, ObjClosure* closure, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.",
+            function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    Value* frameEnd = vm->stackTop - argCount - 1 + function->maxSlots;
+    if ((vm->frameCount == vm->frameCapacity || frameEnd > vm->stackLimit) && !reserveFrame(vm, frameEnd)) {
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = frameAt(vm, vm->frameCount++);
+    frame->function = function;
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->ip = function->chunk.code;
+    frame->slots = vm->stackTop - argCount - 1;
+#ifdef BASELINE_JIT
+    warmUp(vm, function);
+#endif
     return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
+    return callFunction(vm, closure->function, closure, argCount);
+}
+
+/**
+ * @brief Free the lazily bound methods nothing on the stack refers to any more.
+ * They never get stored anywhere else, so those can't be reached. The GC calls this before marking them.
+ */
+void reclaimLazyBounds(VM* vm) {
+    for (int i = 0; i < vm->lazyBoundCapacity; i++) {
+        vm->lazyBounds[i].onStack = false;
+    }
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        if (IS_LAZY_BOUND(*slot)) vm->lazyBounds[AS_LAZY_BOUND(*slot)].onStack = true;
+    }
+
+    vm->freeLazyBoundCount = 0;
+    for (int i = vm->lazyBoundCapacity - 1; i >= 0; i--) {
+        LazyBound* bound = &vm->lazyBounds[i];
+        if (bound->onStack) continue;
+        bound->receiver = NIL_VAL;
+        bound->method = NULL;
+        vm->freeLazyBounds[vm->freeLazyBoundCount++] = i;
+    }
+}
+
+static void growLazyBounds(VM* vm) {
+    int oldCapacity = vm->lazyBoundCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    // Plain realloc, like the stack they aren't part of the heap.
+    LazyBound* bounds = (LazyBound*)realloc(vm->lazyBounds, sizeof(LazyBound) * capacity);
+    int* freeList = (int*)realloc(vm->freeLazyBounds, sizeof(int) * capacity);
+    if (bounds == NULL || freeList == NULL) exit(1);
+
+    for (int i = capacity - 1; i >= oldCapacity; i--) {
+        bounds[i].receiver = NIL_VAL;
+        bounds[i].method = NULL;
+        freeList[vm->freeLazyBoundCount++] = i;
+    }
+    vm->lazyBounds = bounds;
+    vm->freeLazyBounds = freeList;
+    vm->lazyBoundCapacity = capacity;
+}
+
+/**
+ * @brief Bind a method to its receiver without allocating, see LazyBound.
+ * Reclaims the entries the stack is done with when it runs out, so the stack has to be up to date.
+ * @return the value standing for the bound method, to go on the stack
+ */
+static Value bindLazily(VM* vm, Value receiver, ObjClosure* method) {
+    if (vm->freeLazyBoundCount == 0) {
+        reclaimLazyBounds(vm);
+        // Grow when the stack holds on to most of them, so reclaiming stays rare.
+        if (vm->freeLazyBoundCount <= vm->lazyBoundCapacity / 2) growLazyBounds(vm);
+    }
+
+    int index = vm->freeLazyBounds[--vm->freeLazyBoundCount];
+    vm->lazyBounds[index].receiver = receiver;
+    vm->lazyBounds[index].method = method;
+    return LAZY_BOUND_VAL(index);
+}
+
+/**
+ * @brief Give a lazily bound method an ObjBoundMethod, before it gets stored somewhere other than the stack.
+ * Every copy of it on the stack is replaced with the object, so they all stay the same value.
+ * Can allocate, so the stack has to be up to date.
+ * @param slot stack slot holding the value, left alone unless it's lazily bound
+ */
+static void materializeBound(VM* vm, Value* slot) {
+    if (!IS_LAZY_BOUND(*slot)) return;
+
+    int index = AS_LAZY_BOUND(*slot);
+    LazyBound* lazy = &vm->lazyBounds[index];
+    Value bound = OBJ_VAL(newBoundMethod(vm, lazy->receiver, lazy->method));
+    for (Value* copy = vm->stack; copy < vm->stackTop; copy++) {
+        if (IS_LAZY_BOUND(*copy) && AS_LAZY_BOUND(*copy) == index) *copy = bound;
+    }
+    // Closing an upvalue can hand over a slot the stack has already given up.
+    *slot = bound;
+
+    lazy->receiver = NIL_VAL;
+    lazy->method = NULL;
+    vm->freeLazyBounds[vm->freeLazyBoundCount++] = index;
+}
+
+/**
+ * @brief Print a value from the stack, which might be a lazily bound method.
+ */
+static void printStackValue(VM* vm, Value value) {
+    if (IS_LAZY_BOUND(value)) {
+        // Bound methods print like their method.
+        printValue(OBJ_VAL(vm->lazyBounds[AS_LAZY_BOUND(value)].method));
+        return;
+    }
+    printValue(value);
+}
+
+static bool callValue(VM* vm, Value callee, int argCount) {
+    if (IS_LAZY_BOUND(callee)) {
+        LazyBound* bound = &vm->lazyBounds[AS_LAZY_BOUND(callee)];
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+    }
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return call(vm, bound->method, argCount);
             }
             case OBJ_CLASS:
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 
                 // Call init() function if there is one.
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (klass->initializer != NULL) {
+                    return call(vm, klass->initializer, argCount);
                 } else if (argCount != 0) {
                     // Error if no init() and args are passed in.
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+                    return false;
                 }
                 return true;
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), argCount);
+                return call(vm, AS_CLOSURE(callee), argCount);
+            case OBJ_FUNCTION:
+                return callFunction(vm, AS_FUNCTION(callee), NULL, argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                // Natives only ever see flat strings, and real bound methods since they could keep them.
+                for (Value* arg = vm->stackTop - argCount; arg < vm->stackTop; arg++) {
+                    if (IS_ROPE(*arg)) *arg = OBJ_VAL(flattenString(vm, AS_STRING(*arg)));
+                    materializeBound(vm, arg);
+                }
+                Value result = native(vm, argCount, vm->stackTop - argCount);
+                vm->stackTop -= argCount + 1;
+                push(vm, result);
                 return true;
             }
             default:
                 break; // Non-callable object-type
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+/**
+ * @brief Forget everything in the megamorphic property cache.
+ * The cache doesn't keep its classes alive, so the GC calls this before anything gets freed.
+ */
+void clearMegamorphicCache(VM* vm) {
+    for (int i = 0; i < MEGAMORPHIC_CACHE_SIZE; i++) {
+        vm->megamorphicCache[i].name = NULL;
+        vm->megamorphicCache[i].entry.shape = NULL;
+    }
+}
+
+static inline uint32_t megamorphicIndex(ObjShape* shape, ObjString* name) {
+    return ((uint32_t)((uintptr_t)shape >> 4) ^ name->hash) & (MEGAMORPHIC_CACHE_SIZE - 1);
+}
+
+/**
+ * @brief Forget everything in the method cache.
+ * Like the megamorphic cache it doesn't keep anything alive, and it holds young objects too, so
+ * the GC calls this before anything gets freed or moved.
+ */
+void clearMethodCache(VM* vm) {
+    for (int i = 0; i < METHOD_CACHE_SIZE; i++) {
+        vm->methodCache[i].klass = NULL;
+    }
+}
+
+static inline uint32_t methodCacheIndex(ObjClass* klass, ObjString* name) {
+    return ((uint32_t)((uintptr_t)klass >> 4) ^ name->hash) & (METHOD_CACHE_SIZE - 1);
+}
+
+/**
+ * @brief Look up a method on a class, going through the method cache.
+ * @param klass class to look on
+ * @param name method name
+ * @return the method's closure, or NULL if the class has no such method
+ */
+static ObjClosure* findMethod(VM* vm, ObjClass* klass, ObjString* name) {
+    MethodCacheEntry* entry = &vm->methodCache[methodCacheIndex(klass, name)];
+    if (entry->klass == klass && entry->name == name) return entry->method;
+
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+    if (!tableGet(&klass->methods, name, &method)) return NULL;
+    entry->klass = klass;
+    entry->name = name;
+    entry->method = AS_CLOSURE(method);
+    return entry->method;
+}
+
+/**
+ * @brief Look for a shape in an inline cache, falling back to the megamorphic cache once the instruction has seen too many.
+ * @param cache inline cache of the instruction doing the lookup
+ * @param shape receiver's shape, not NULL
+ * @param name property name
+ * @return matching entry, or NULL on a miss
+ */
+static inline CacheEntry* findCacheEntry(VM* vm, InlineCache* cache, ObjShape* shape, ObjString* name) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+
+    if (cache->count == IC_POLYMORPHIC_SIZE) {
+        MegamorphicEntry* megamorphic = &vm->megamorphicCache[megamorphicIndex(shape, name)];
+        if (megamorphic->entry.shape == shape && megamorphic->name == name) return &megamorphic->entry;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Remember what a property resolved to for a shape.
+ * Transitions are only kept in the instruction's own cache, since the megamorphic cache is
+ * shared with instructions that read properties.
+ * @param cache inline cache of the instruction doing the lookup
+ * @param shape receiver's shape, not NULL
+ * @param name property name
+ * @param index slot of the field, or -1 for a method
+ * @param method the method's closure when index is -1
+ * @param transition shape after adding the field, for property sets that add one
+ */
+static void updateCache(VM* vm, InlineCache* cache, ObjShape* shape, ObjString* name, int index,
+                        Value method, ObjShape* transition) {
+    // Only cache old objects, so a minor GC never has to fix up caches. Ask for one to promote
+    // them instead, then the next miss can cache them.
+    if (shape->obj.isYoung || (transition != NULL && transition->obj.isYoung) ||
+        (IS_OBJ(method) && AS_OBJ(method)->isYoung)) {
+        vm->minorGCRequested = true;
+        return;
+    }
+
+    CacheEntry* entry;
+    if (cache->count < IC_POLYMORPHIC_SIZE) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        if (transition != NULL) return;
+        MegamorphicEntry* megamorphic = &vm->megamorphicCache[megamorphicIndex(shape, name)];
+        megamorphic->name = name;
+        entry = &megamorphic->entry;
+    }
+
+    entry->shape = shape;
+    entry->index = index;
+    entry->method = method;
+    entry->transition = transition;
+
+    // Inline caches keep what they hold alive, the marker needs to hear about it.
+    writeBarrier(vm, NULL, OBJ_VAL(shape));
+    writeBarrier(vm, NULL, method);
+    if (transition != NULL) writeBarrier(vm, NULL, OBJ_VAL(transition));
+}
+
+/**
+ * @brief Find where a property lives on an instance, going through the instruction's inline cache.
+ * Does the full field and method lookup on a miss, and caches the result if the instance has a shape.
+ * @param cache inline cache of the instruction doing the lookup
+ * @param instance receiver of the property access
+ * @param name property name
+ * @param slot set to the field's slot, or -1 if the property is a method
+ * @param method set to the method's closure if the property is a method
+ * @return false if the instance has no such property
+ */
+static inline bool resolveProperty(VM* vm, InlineCache* cache, ObjInstance* instance, ObjString* name,
+                                   int* slot, Value* method) {
+    if (instance->shape != NULL) {
+        CacheEntry* entry = findCacheEntry(vm, cache, instance->shape, name);
+        if (entry != NULL && entry->transition == NULL) {
+            *slot = entry->index;
+            *method = entry->method;
+            return true;
+        }
+    }
+
+    // Cache miss, do the full lookup.
+    *slot = instanceFindSlot(instance, name);
+    *method = NIL_VAL;
+    if (*slot < 0) {
+        ObjClosure* closure = findMethod(vm, instance->klass, name);
+        if (closure == NULL) return false;
+        *method = OBJ_VAL(closure);
+    }
+
+    if (instance->shape != NULL) {
+        updateCache(vm, cache, instance->shape, name, *slot, *method, NULL);
+    }
+    return true;
+}
+
+/**
+ * @brief Set a field on an instance, going through the instruction's inline cache.
+ * Overwrites the field if the instance has it, otherwise adds it and moves the instance to its next shape.
+ * @param cache inline cache of the OP_SET_PROPERTY doing the set
+ * @param instance instance to set on, must be on the stack
+ * @param name field name
+ * @param value value to store, must be on the stack
+ */
+static void setProperty(VM* vm, InlineCache* cache, ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = instance->shape;
+    if (shape != NULL) {
+        CacheEntry* entry = findCacheEntry(vm, cache, shape, name);
+        if (entry != NULL && entry->index >= 0) {
+            if (entry->transition == NULL) {
+                instance->fields[entry->index] = value;
+                writeBarrier(vm, (Obj*)instance, value);
+                return;
+            }
+            // Adding a field we've added to this shape before. Just needs room for it.
+            if (entry->index < instance->fieldCapacity) {
+                instance->fields[entry->index] = value;
+                instance->fieldCount++;
+                instance->shape = entry->transition;
+                writeBarrier(vm, (Obj*)instance, value);
+                return;
+            }
+        }
+    }
+
+    // Cache miss, or the fields need to grow.
+    int slot = instanceFindSlot(instance, name);
+    if (slot >= 0) {
+        instance->fields[slot] = value;
+        writeBarrier(vm, (Obj*)instance, value);
+        if (shape != NULL) updateCache(vm, cache, shape, name, slot, NIL_VAL, NULL);
+        return;
+    }
+
+    instanceAddField(vm, instance, name, value);
+    if (shape != NULL && instance->shape != NULL) {
+        updateCache(vm, cache, shape, name, instance->fieldCount - 1, NIL_VAL, instance->shape);
+    }
+}
+
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount) {
+    ObjClosure* method = findMethod(vm, klass, name);
+    if (method == NULL) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(vm, method, argCount);
 }
 
 /**
  * @brief invoke a method name by looking it up and calling it.
  * @param name name of method
  * @param argCount arity of method
+ * @param cache inline cache of the OP_INVOKE doing the call
  * @return true if invocation succeeded, false otherwise 
  */
-static bool invoke(ObjString* name, int argCount) {
-    Value receiver = peek(argCount);
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    Value receiver = peek(vm, argCount);
 
     if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods.");
+        runtimeError(vm, "Only instances have methods.");
         return false;
     }
 
     ObjInstance* instance = AS_INSTANCE(receiver);
+    int slot;
+    Value method;
+    if (!resolveProperty(vm, cache, instance, name, &slot, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
 
     // Put a field on the stack if we find one.
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    if (slot >= 0) {
+        Value value = instance->fields[slot];
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+    ObjClosure* method = findMethod(vm, klass, name);
+    if (method == NULL) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-
-    pop();
-    push(OBJ_VAL(bound));
+    vm->stackTop[-1] = bindLazily(vm, peek(vm, 0), method);
     return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
-    // Check through linked list of upvalues to get to the correction location in the stack/linked list.
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+    // If the slot is already captured, share its upvalue.
+    ObjUpvalue** slot = &vm->openUpvalueSlots[local - vm->stack];
+    if (*slot != NULL) return *slot;
+
+    // Otherwise need to create a new value here. It usually goes on the front of the list, as locals
+    // get captured from the top of the stack, only a slot below ones already captured walks the list.
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
     }
 
-    // If we equal a value already in the linked list, return that early
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
-
-    // Otherwise need to create a new value here.
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
+    *slot = createdUpvalue;
 
     // If we ran out of upvalues to search, this one will be the start of the linked list.
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         // Otherwise have the previous upvalue point to this one now.
         prevUpvalue->next = createdUpvalue;
@@ -263,12 +738,15 @@ static ObjUpvalue* captureUpvalue(Value* local) {
  * @brief Helper function for moving closed variables off the stack to the heap.
  * @param last address of stack slot
  */
-static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+static void closeUpvalues(VM* vm, Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        vm->openUpvalueSlots[upvalue->location - vm->stack] = NULL;
+        materializeBound(vm, upvalue->location);
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        writeBarrier(vm, (Obj*)upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
@@ -276,11 +754,30 @@ static void closeUpvalues(Value* last) {
  * @brief Define a method for a class
  * @param name Name of the method
  */
-static void defineMethod(ObjString* name) {
-    Value method = peek(0);
-    ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
-    pop();
+static void defineMethod(VM* vm, ObjString* name) {
+    Value method = peek(vm, 0);
+    ObjClass* klass = AS_CLASS(peek(vm, 1));
+    tableSet(vm, &klass->methods, name, method);
+    if (name == vm->initString) {
+        klass->initializer = AS_CLOSURE(method);
+        writeBarrier(vm, (Obj*)klass, method);
+    }
+    // Overriding a method, inherited or defined twice, would leave the old one in the cache.
+    MethodCacheEntry* cached = &vm->methodCache[methodCacheIndex(klass, name)];
+    if (cached->klass == klass && cached->name == name) cached->klass = NULL;
+    pop(vm);
+}
+
+/**
+ * @brief Copy a superclass's methods down into a subclass that doesn't have any yet.
+ * @param superclass 
+ * @param subclass 
+ */
+static void inherit(VM* vm, ObjClass* superclass, ObjClass* subclass) {
+    tableAddAll(vm, &superclass->methods, &subclass->methods);
+    subclass->initializer = superclass->initializer;
+    if (subclass->initializer != NULL) writeBarrier(vm, (Obj*)subclass, OBJ_VAL(subclass->initializer));
+    // Nothing's looked anything up on the subclass yet, so there's nothing to forget in the method cache.
 }
 
 /**
@@ -292,327 +789,723 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static void concatenate(VM* vm) {
+    ObjString* b = AS_STRING(peek(vm, 0));
+    ObjString* a = AS_STRING(peek(vm, 1));
+    ObjString* result = concatenateStrings(vm, a, b);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+/**
+ * @brief Flatten any ropes in the top two stack slots, after which equal strings are the same object.
+ */
+static void flattenOperands(VM* vm) {
+    for (Value* slot = vm->stackTop - 2; slot < vm->stackTop; slot++) {
+        if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenString(vm, AS_STRING(*slot)));
+    }
 }
 
 /**
  * @brief Code used for interpreting bytecode
+ *
+ * The hot parts of the current CallFrame (ip, slots, and the constant table) and the VM's stackTop
+ * are kept in locals so the compiler can hold them in registers. They're written back to the frame
+ * and VM with STORE_FRAME() before anything that can look at them from outside of run() -
+ * calls, returns, runtime errors, and allocations that might kick off a GC.
+ * @param baseFrame index of the frame run() was started for. run() returns once that frame returns,
+ * which lets compiled code run a callee that hasn't been compiled in a nested run().
  * @return Status of the intrepretation, either OK or some error
  */
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+static InterpretResult run(VM* vm, int baseFrame) {
+    CallFrame* frame;
+    register uint8_t* ip;
+    register Value* slots;
+    register Value* constants;
+    register InlineCache* caches;
+    register Value* stackTop = vm->stackTop;
+
+// Write the cached ip and stackTop back so helpers, the GC and runtimeError() see them.
+#define STORE_FRAME() \
+    do { \
+        frame->ip = ip; \
+        vm->stackTop = stackTop; \
+    } while (false)
+
+// Reload the cached frame state after the current frame changes.
+#define LOAD_FRAME() \
+    do { \
+        frame = frameAt(vm, vm->frameCount - 1); \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->function->chunk.constants.values; \
+        caches = frame->function->chunk.caches; \
+    } while (false)
 
 // Read one byte, increment ip
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 
 // Read two bytes, increment ip
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define READ_CACHE() (&caches[READ_SHORT()])
+
+// Stack operations on the cached stackTop, versions of push()/pop()/peek() that don't touch vm->stackTop.
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define DROP() (stackTop--) // pop() without reading the value.
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
 // Preprocessor hack to mack sure semicolon statements end up in same block
 #define BINARY_OP(valueType, op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
         } while (false)
 
-    for(;;) {
+// Loops and calls are the safepoints, where a minor GC is allowed to move young objects.
+// Nothing but the frame caches here points at them, and LOAD_FRAME() reloads those.
+#define SAFEPOINT() \
+    do { \
+        if (vm->minorGCRequested) { \
+            STORE_FRAME(); \
+            collectNursery(vm); \
+            LOAD_FRAME(); \
+            stackTop = vm->stackTop; \
+        } \
+    } while (false)
+
+#ifdef BASELINE_JIT
+// If the call just made pushed a frame for a compiled function, run that frame in native code.
+// It comes back with the frame popped and the result on the stack, like OP_RETURN.
+#define RUN_COMPILED_CALLEE() \
+    do { \
+        CallFrame* callee = frameAt(vm, vm->frameCount - 1); \
+        if (callee != frame && canEnterJit(vm, callee->function) && \
+            !jitEnter(vm, callee, NULL)) { \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+#else
+#define RUN_COMPILED_CALLEE() do { } while (false)
+#endif
+
+// Give the value on top of the stack an ObjBoundMethod if it's lazily bound, before it gets stored off the stack.
+#define MATERIALIZE_TOP() \
+    do { \
+        if (IS_LAZY_BOUND(PEEK(0))) { \
+            STORE_FRAME(); \
+            materializeBound(vm, stackTop - 1); \
+        } \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (Value* slot = vm->stack; slot < stackTop; slot++) { \
+            printf("[ "); \
+            printStackValue(vm, *slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleInstruction(vm, &frame->function->chunk, \
+            (int)(ip - frame->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT:
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+
+#ifdef COMPUTED_GOTO
+    // One label per opcode, indexed by the OpCode value. Every handler ends by jumping
+    // straight to the next handler, so each opcode gets its own indirect branch for the
+    // CPU to predict instead of all sharing the one at the top of a switch.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT]       = &&op_CONSTANT,
+        [OP_NIL]            = &&op_NIL,
+        [OP_TRUE]           = &&op_TRUE,
+        [OP_FALSE]          = &&op_FALSE,
+        [OP_POP]            = &&op_POP,
+        [OP_GET_LOCAL]      = &&op_GET_LOCAL,
+        [OP_SET_LOCAL]      = &&op_SET_LOCAL,
+        [OP_GET_GLOBAL]     = &&op_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL]  = &&op_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]     = &&op_SET_GLOBAL,
+        [OP_GET_UPVALUE]    = &&op_GET_UPVALUE,
+        [OP_SET_UPVALUE]    = &&op_SET_UPVALUE,
+        [OP_GET_PROPERTY]   = &&op_GET_PROPERTY,
+        [OP_SET_PROPERTY]   = &&op_SET_PROPERTY,
+        [OP_GET_SUPER]      = &&op_GET_SUPER,
+        [OP_EQUAL]          = &&op_EQUAL,
+        [OP_GREATER]        = &&op_GREATER,
+        [OP_LESS]           = &&op_LESS,
+        [OP_ADD]            = &&op_ADD,
+        [OP_SUBTRACT]       = &&op_SUBTRACT,
+        [OP_MULTIPLY]       = &&op_MULTIPLY,
+        [OP_DIVIDE]         = &&op_DIVIDE,
+        [OP_NOT]            = &&op_NOT,
+        [OP_NEGATE]         = &&op_NEGATE,
+        [OP_PRINT]          = &&op_PRINT,
+        [OP_JUMP]           = &&op_JUMP,
+        [OP_JUMP_IF_FALSE]  = &&op_JUMP_IF_FALSE,
+        [OP_LOOP]           = &&op_LOOP,
+        [OP_CALL]           = &&op_CALL,
+        [OP_INVOKE]         = &&op_INVOKE,
+        [OP_SUPER_INVOKE]   = &&op_SUPER_INVOKE,
+        [OP_CLOSURE]        = &&op_CLOSURE,
+        [OP_CLOSE_UPVALUE]  = &&op_CLOSE_UPVALUE,
+        [OP_RETURN]         = &&op_RETURN,
+        [OP_CLASS]          = &&op_CLASS,
+        [OP_INHERIT]        = &&op_INHERIT,
+        [OP_METHOD]         = &&op_METHOD,
+    };
+
+// Jump directly to the handler of the next instruction.
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#define CASE(name) op_##name
+#define INTERPRET_LOOP DISPATCH();
+#else
+// Portable fallback - go back to the top of the loop and switch on the next instruction.
+#define DISPATCH() goto dispatch
+#define CASE(name) case OP_##name
+#define INTERPRET_LOOP \
+    dispatch: \
+        TRACE_INSTRUCTION(); \
+        switch (READ_BYTE())
+#endif
+
+    LOAD_FRAME();
+    INTERPRET_LOOP
+    {
+        CASE(CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(POP): DROP(); DISPATCH();
+        CASE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            MATERIALIZE_TOP();
+            vm->globalValues.values[slot] = PEEK(0);
+            writeBarrier(vm, NULL, PEEK(0));
+            DROP();
+            DISPATCH();
+        }
+        CASE(SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            // If the global hasn't been defined yet, it's an error.
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            MATERIALIZE_TOP();
+            vm->globalValues.values[slot] = PEEK(0);
+            writeBarrier(vm, NULL, PEEK(0));
+            DISPATCH();
+        }
+        CASE(GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            MATERIALIZE_TOP();
+            *upvalue->location = PEEK(0);
+            writeBarrier(vm, (Obj*)upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(GET_PROPERTY): {
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                // If key doesn't exist yet, it's an error.
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s', name->chars");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            ObjString* name = READ_STRING();
+            int slot;
+            Value method;
+            if (!resolveProperty(vm, READ_CACHE(), instance, name, &slot, &method)) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+
+            // If instance has the field, replace the instance with the field value
+            if (slot >= 0) {
+                PEEK(0) = instance->fields[slot];
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            // Otherwise it's a method, bind it to the instance.
+            STORE_FRAME();
+            PEEK(0) = bindLazily(vm, PEEK(0), AS_CLOSURE(method));
+            DISPATCH();
+        }
+        CASE(SET_PROPERTY): {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            materializeBound(vm, stackTop - 1);
+            setProperty(vm, cache, instance, name, PEEK(0));
+            // If we type toast.jam = grape, then 
+            // our stack is [toast] [grape], we want to get rid of toast and store grape where it was.
+            Value value = POP(); // grape.
+            DROP(); // Bye toast.
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(POP());
 
-                Value value;
-                // If instance has the field, pop the instance and push the field value
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-                // Check for (bound) method, error otherwise
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            STORE_FRAME();
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                // If we type toast.jam = grape, then 
-                // our stack is [toast] [grape], we want to get rid of toast and store grape where it was.
-                Value value = pop(); // grape.
-                pop(); // Bye toast.
-                push(value);
-                break;
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(EQUAL): {
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+                STORE_FRAME();
+                flattenOperands(vm);
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();  
+        CASE(ADD): {
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                STORE_FRAME();
+                concatenate(vm);
+                stackTop = vm->stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR("Opearands must be two numbers or two strings.");
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            DISPATCH();
+        }
+        CASE(SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(NEGATE):   
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Opearand must be a number.");
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;  
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Opearands must be two numbers or two strings.");
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(PRINT): {
+            printStackValue(vm, POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            SAFEPOINT();
+#ifdef BASELINE_JIT
+            STORE_FRAME();
+            if (warmUp(vm, frame->function) && canEnterJit(vm, frame->function)) {
+                // Hot loop, run the rest of the function in native code starting from the top of the loop.
+                if (!jitEnter(vm, frame, ip)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:   
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Opearand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                // Same as the end of OP_RETURN.
+                if (vm->frameCount == 0) {
+                    vm->stackTop = vm->stack;
+                    return INTERPRET_OK;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+                if (vm->frameCount == baseFrame) return INTERPRET_OK;
+                LOAD_FRAME();
+                stackTop = vm->stackTop;
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+#endif
+            DISPATCH();
+        }
+        CASE(CALL): {
+            int argCount = READ_BYTE();
+            SAFEPOINT();
+            STORE_FRAME();
+            if (!callValue(vm, PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            RUN_COMPILED_CALLEE();
+            LOAD_FRAME();
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(INVOKE): {
+            int nameConstant = READ_BYTE();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            SAFEPOINT();
+            ObjString* method = AS_STRING(constants[nameConstant]);
+            STORE_FRAME();
+            if (!invoke(vm, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            RUN_COMPILED_CALLEE();
+            LOAD_FRAME();
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(SUPER_INVOKE): {
+            int nameConstant = READ_BYTE();
+            int argCount = READ_BYTE();
+            SAFEPOINT();
+            ObjString* method = AS_STRING(constants[nameConstant]);
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!invokeFromClass(vm, superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            RUN_COMPILED_CALLEE();
+            LOAD_FRAME();
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure* closure = newClosure(vm, function);
+            PUSH(OBJ_VAL(closure));
+            vm->stackTop = stackTop; // Keep the closure visible to the GC while capturing.
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(vm, slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(CLOSE_UPVALUE):
+            STORE_FRAME();
+            closeUpvalues(vm, stackTop - 1);
+            DROP();
+            DISPATCH();
+        CASE(RETURN): {
+            // Closing upvalues can allocate, so the result stays on the stack until they're closed.
+            STORE_FRAME();
+            closeUpvalues(vm, slots);
+            // StackTop should have the result of the function call, save it.
+            Value result = POP();
+            vm->frameCount--;
+            // If we're at the end of the main script, exit the whole program.
+            if (vm->frameCount == 0) {
+                DROP();
+                vm->stackTop = stackTop;
+                return INTERPRET_OK;
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                // StackTop should have the result of the function call, save it.
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                // If we're at the end of the main script, exit the whole program.
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
 
-                // Set stackTop to before the function was called.
-                vm.stackTop = frame->slots;
-                // Store the result of the function back on the stack, minus the function call now.
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            // Set stackTop to before the function was called.
+            stackTop = slots;
+            // Store the result of the function back on the stack, minus the function call now.
+            PUSH(result);
+            if (vm->frameCount == baseFrame) {
+                vm->stackTop = stackTop;
+                return INTERPRET_OK;
             }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if(!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(CLASS): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(vm, name)));
+            DISPATCH();
+        }
+        CASE(INHERIT): {
+            Value superclass = PEEK(1);
+            if(!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            STORE_FRAME();
+            inherit(vm, AS_CLASS(superclass), subclass);
+            DROP(); // Subclass.
+            DISPATCH();
+        }
+        CASE(METHOD): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(vm, name);
+            stackTop = vm->stackTop;
+            DISPATCH();
         }
     }
 
+    // Only reachable if the switch fallback reads a byte that isn't an opcode.
+    RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef DROP
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef SAFEPOINT
+#undef RUN_COMPILED_CALLEE
+#undef TRACE_INSTRUCTION
+#undef MATERIALIZE_TOP
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+}
+
+#ifdef BASELINE_JIT
+/**
+ * @brief Finish a call made from compiled code by running the frame it pushed, if it pushed one.
+ * Compiled callees run in native code, the rest in a nested run() that stops once the frame returns.
+ * @param frameCount number of frames before the call
+ * @return false if there was a runtime error
+ */
+static bool finishCall(VM* vm, int frameCount) {
+    if (vm->frameCount == frameCount) return true; // Natives and classes without an init() are done already.
+
+    CallFrame* frame = frameAt(vm, vm->frameCount - 1);
+    if (canEnterJit(vm, frame->function)) return jitEnter(vm, frame, NULL);
+    return run(vm, vm->frameCount - 1) == INTERPRET_OK;
+}
+
+static inline ObjString* constantString(CallFrame* frame, int constant) {
+    return AS_STRING(frame->function->chunk.constants.values[constant]);
+}
+
+bool jitCall(VM* vm, int argCount) {
+    int frameCount = vm->frameCount;
+    return callValue(vm, peek(vm, argCount), argCount) && finishCall(vm, frameCount);
+}
+
+bool jitInvoke(VM* vm, CallFrame* frame, int nameConstant, int argCount, int cacheIndex) {
+    InlineCache* cache = &frame->function->chunk.caches[cacheIndex];
+    int frameCount = vm->frameCount;
+    return invoke(vm, constantString(frame, nameConstant), argCount, cache) && finishCall(vm, frameCount);
+}
+
+bool jitSuperInvoke(VM* vm, CallFrame* frame, int nameConstant, int argCount) {
+    ObjClass* superclass = AS_CLASS(pop(vm));
+    int frameCount = vm->frameCount;
+    return invokeFromClass(vm, superclass, constantString(frame, nameConstant), argCount) &&
+        finishCall(vm, frameCount);
+}
+
+bool jitGetProperty(VM* vm, CallFrame* frame, int nameConstant, int cacheIndex) {
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+    ObjString* name = constantString(frame, nameConstant);
+    int slot;
+    Value method;
+    if (!resolveProperty(vm, &frame->function->chunk.caches[cacheIndex], instance, name, &slot, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (slot >= 0) {
+        vm->stackTop[-1] = instance->fields[slot];
+    } else {
+        vm->stackTop[-1] = bindLazily(vm, peek(vm, 0), AS_CLOSURE(method));
+    }
+    return true;
+}
+
+bool jitSetProperty(VM* vm, CallFrame* frame, int nameConstant, int cacheIndex) {
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields.");
+        return false;
+    }
+
+    materializeBound(vm, vm->stackTop - 1);
+    setProperty(vm, &frame->function->chunk.caches[cacheIndex], AS_INSTANCE(peek(vm, 1)),
+                constantString(frame, nameConstant), peek(vm, 0));
+    Value value = pop(vm);
+    pop(vm);
+    push(vm, value);
+    return true;
 }
 
+bool jitGetSuper(VM* vm, CallFrame* frame, int nameConstant) {
+    ObjClass* superclass = AS_CLASS(pop(vm));
+    return bindMethod(vm, superclass, constantString(frame, nameConstant));
+}
+
+// OP_ADD when the operands aren't both numbers.
+bool jitAdd(VM* vm) {
+    if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+        concatenate(vm);
+        return true;
+    }
+    runtimeError(vm, "Opearands must be two numbers or two strings.");
+    return false;
+}
+
+// OP_EQUAL on two different objects, which could be equal strings if either is a rope.
+void jitFlattenOperands(VM* vm) {
+    flattenOperands(vm);
+}
+
+bool jitInherit(VM* vm) {
+    Value superclass = peek(vm, 1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError(vm, "Superclass must be a class.");
+        return false;
+    }
+    inherit(vm, AS_CLASS(superclass), AS_CLASS(peek(vm, 0)));
+    pop(vm); // Subclass.
+    return true;
+}
+
+void jitError(VM* vm, const char* message) {
+    runtimeError(vm, "%s", message);
+}
+
+void jitUndefinedVariable(VM* vm, int slot) {
+    runtimeError(vm, "Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+}
+
+// OP_DEFINE_GLOBAL, OP_SET_GLOBAL and OP_SET_UPVALUE when the value is lazily bound.
+void jitMaterializeTop(VM* vm) {
+    materializeBound(vm, vm->stackTop - 1);
+}
+
+void jitPrint(VM* vm) {
+    printStackValue(vm, pop(vm));
+    printf("\n");
+}
+
+/**
+ * @brief OP_CLOSURE for compiled code.
+ * @param frame 
+ * @param offset bytecode offset of the instruction's operands
+ */
+void jitClosure(VM* vm, CallFrame* frame, int offset) {
+    Chunk* chunk = &frame->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[*ip++]);
+    ObjClosure* closure = newClosure(vm, function);
+    push(vm, OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *ip++;
+        uint8_t index = *ip++;
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+void jitCloseUpvalues(VM* vm, Value* last) {
+    closeUpvalues(vm, last);
+}
+
+void jitClass(VM* vm, CallFrame* frame, int nameConstant) {
+    push(vm, OBJ_VAL(newClass(vm, constantString(frame, nameConstant))));
+}
+
+void jitMethod(VM* vm, CallFrame* frame, int nameConstant) {
+    defineMethod(vm, constantString(frame, nameConstant));
+}
+
+void jitSafepoint(VM* vm) {
+    collectNursery(vm);
+}
+
+void jitWriteBarrier(VM* vm, Obj* owner, Value value) {
+    writeBarrier(vm, owner, value);
+}
+#endif
+
 /**
  * @brief Take a new chunk, pass it to compiler, which fills chunk with bytecode.
  * Send over to vm if no errors.
  * @return Wheather the interpretation was ok, or some error occured
 */
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    // "Main" code runs in a function with 0 args, at the beginning.
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+    // "Main" code runs in a function with 0 args, at the beginning. It captures nothing, so it doesn't need a closure.
+    push(vm, OBJ_VAL(function));
+    callFunction(vm, function, NULL, 0);
 
-    return run();
+    return run(vm, 0);
 }
@@ -5,33 +5,126 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 256
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_MAX 10000 //< Default for VM.maxFrames.
+#define TRACE_INNER_FRAMES 16 //< Innermost frames a runtime error's stack trace prints.
+#define TRACE_OUTER_FRAMES 4 //< Outermost frames it prints, anything between is left out.
+#define FRAME_SEGMENT_SIZE 64 //< Frames are allocated this many at a time, so they never move. Must be a power of 2.
+#define STACK_INITIAL 1024 //< Slots the value stack starts with.
+#define STACK_HEADROOM 16 //< Slots call() keeps free past what a frame uses, for values C code pushes to keep them from the GC.
+#define MEGAMORPHIC_CACHE_SIZE 1024 //< Must be a power of 2.
+#define METHOD_CACHE_SIZE 256 //< Must be a power of 2.
+
+typedef struct NurseryBlock NurseryBlock;
+typedef struct Page Page;
+typedef struct Marker Marker;
+typedef struct Parser Parser;
+
+#define SIZE_CLASS_COUNT 25 //< How many size classes the old generation's pools have, see memory.c.
+
+/**
+ * @brief Old objects of one size class, allocated out of pages.
+ */
+typedef struct {
+    Page* pages; //< Every page of the size class.
+    Page* current; //< Page allocation is carrying on from, pages before it are full.
+    Page* unswept; //< Pages the lazy sweep hasn't got to since the last full GC.
+} Pool;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING, //< Incremental marking is part way through, the write barrier shades.
+    GC_SWEEPING, //< Marking is done, old pages are being swept lazily.
+} GcState;
 
 typedef struct {
-    ObjClosure* closure;
+    ObjFunction* function;
+    ObjClosure* closure; //< NULL for a function that captures nothing, those get called without one.
     uint8_t* ip;
     Value* slots; //< Point to VM's value stack of the first slot a function uses.
 } CallFrame;
 
+/**
+ * @brief Slot in the VM-wide property cache that inline caches fall back to once they're megamorphic.
+ */
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    ObjString* name; //< Property name the entry was resolved for, NULL if unused.
+    CacheEntry entry;
+} MegamorphicEntry;
+
+/**
+ * @brief Slot in the VM-wide cache of method lookups that don't go through an inline cache - super calls and bound methods.
+ */
+typedef struct {
+    ObjClass* klass; //< Class the method was looked up on, NULL if unused.
+    ObjString* name;
+    ObjClosure* method;
+} MethodCacheEntry;
+
+/**
+ * @brief A method bound to its receiver without an ObjBoundMethod, so callValue() can call it straight away.
+ * OP_GET_PROPERTY and OP_GET_SUPER make one of these for a method and push LAZY_BOUND_VAL(index).
+ * Those values only ever live on the value stack, so one can be passed to a function, kept in a local
+ * or called without touching the heap. Storing one anywhere else gives it an ObjBoundMethod first.
+ */
+typedef struct {
+    Value receiver;
+    ObjClosure* method; //< NULL if the entry is free.
+    bool onStack; //< Scratch for reclaimLazyBounds().
+} LazyBound;
+
+/**
+ * @brief One interpreter and its heap. Nothing is shared between VMs, so each can run on its own thread.
+ * Objects belong to the VM that allocated them and must never be handed to another one.
+ */
+struct VM {
+    CallFrame** frameSegments; //< Frames, FRAME_SEGMENT_SIZE to a segment, see frameAt().
+    int frameSegmentCount;
+    int frameCapacity; //< Frames call() can use before it has to allocate a segment, never more than maxFrames.
     int frameCount;
+    int maxFrames; //< Deepest the calls can go before a "Stack overflow." error. Set it before running anything.
+    int jitNesting; //< jitEnter() calls running on the C stack, never more than JIT_NESTING_MAX.
 
-    Value stack[STACK_MAX];
+    Value* stack; //< Grows in call(), frames' slots and open upvalues get moved with it.
     Value* stackTop; //< Pointer one beyond the last added value, used for knowing where in the stack we are
-    Table globals; //< Table for global variables.
+    Value* stackLimit; //< call() grows the stack when a new frame would reach past this, STACK_HEADROOM from the end.
+    int stackCapacity;
+    Table globalSlots; //< Global variable name -> index of its slot, assigned when the compiler first sees the name.
+    ValueArray globalNames; //< Name of each global slot, for error messages.
+    ValueArray globalValues; //< Value of each global slot, UNDEFINED_VAL until the global is defined.
     Table strings; //< Table used for string interning - a list of all strings assigned so we can do equality checks.
     ObjString* initString; //< Initializer's name
-    ObjUpvalue* openUpvalues; //< Linked list used for checking new upvalues to existing ones to make sure they all point to a same variable if needed.
+    ObjUpvalue* openUpvalues; //< Open upvalues sorted from the top of the stack down, so closing pops them off the front.
+    ObjUpvalue** openUpvalueSlots; //< Open upvalue of each stack slot, NULL if the slot isn't captured. Sized like the stack.
+    MegamorphicEntry megamorphicCache[MEGAMORPHIC_CACHE_SIZE]; //< Direct mapped on (class, name), cleared every GC.
+    MethodCacheEntry methodCache[METHOD_CACHE_SIZE]; //< Direct mapped on (class, name), cleared every GC.
+    LazyBound* lazyBounds; //< Indexed by AS_LAZY_BOUND(). Entries are roots, like the stack.
+    int lazyBoundCapacity;
+    int* freeLazyBounds; //< Indices of the free entries.
+    int freeLazyBoundCount;
 
     size_t bytesAllocated; //< How many bytes have been allocated by the vm.
     size_t nextGC; //< Threshold on when to trigger next GC.
-    Obj* objects;
+    Pool pools[SIZE_CLASS_COUNT]; //< Old generation, every object that survived a minor GC and isn't too big for a pool.
+    Page* largePages; //< Rest of the old generation, each object in a page of its own.
+    Page* largeUnswept; //< Large object pages the lazy sweep hasn't got to.
+    NurseryBlock* nursery; //< Newest block of the nursery, young objects are bump allocated from it.
+    uint8_t* nurseryTop; //< Next free byte in the newest nursery block.
+    uint8_t* nurseryEnd; //< End of the newest nursery block.
+    bool minorGCRequested; //< Set when the nursery fills up, run() collects it at the next safepoint.
+    int rememberedCount; //< How many old objects are in the remembered set.
+    int rememberedCapacity; //< Size of the remembered set.
+    Obj** remembered; //< Old objects that might point at young ones, found by the write barrier.
+    GcState gcState; //< What the full GC is doing.
+    uint64_t gcPauseBudget; //< Longest an incremental marking step runs for, in microseconds.
+    int gcThreads; //< Threads to mark with once the heap is past PARALLEL_MARK_MIN_HEAP, see memory.c.
+    int compactThreshold; //< Percent of the pools that can be holes before the old generation gets compacted.
+    bool compactRequested; //< Set by the sweep when the pools are too fragmented, compacted after the next minor GC.
     int grayCount; //< How many GC objects are marked gray
     int grayCapacity; //< Size of gray stack
     Obj** grayStack; //< Stack used to keep track of gray objects as we GC
-} VM;
+    Marker* marker; //< Helper threads for parallel marking, NULL until the first parallel step.
+    Parser* parser; //< Compile in progress, NULL if there isn't one. The functions it's building are roots.
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -39,12 +132,22 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+/**
+ * @brief Frame at depth index, 0 being the script. Frames stay put when more get allocated,
+ * so run() and compiled code can hold on to a frame pointer across calls.
+ */
+static inline CallFrame* frameAt(VM* vm, int index) {
+    return &vm->frameSegments[(unsigned)index / FRAME_SEGMENT_SIZE][(unsigned)index % FRAME_SEGMENT_SIZE];
+}
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+int globalSlot(VM* vm, ObjString* name);
+void clearMegamorphicCache(VM* vm);
+void clearMethodCache(VM* vm);
+void reclaimLazyBounds(VM* vm);
 
 #endif